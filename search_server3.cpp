@@ -1,13 +1,51 @@
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
 #include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <condition_variable>
+#include <cstring>
+#include <execution>
+#include <fstream>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <list>
+#include <limits>
 #include <map>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <queue>
+#include <random>
 #include <set>
+#include <sstream>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 using namespace std;
 
 const int MAX_RESULT_DOCUMENT_COUNT = 5;
@@ -26,23 +64,88 @@ int ReadLineWithNumber() {
     return result;
 }
 
-vector<string> SplitIntoWords(const string& text) {
-    vector<string> words;
-    string word;
-    for (const char c : text) {
-        if (c == ' ') {
-            if (!word.empty()) {
-                words.push_back(word);
-                word.clear();
+// Bytes of text are classified TEXT_CHUNK_SIZE at a time
+const size_t TEXT_CHUNK_SIZE = 16;
+
+// Bit i of spaces is set when the i-th byte is a space, bit i of control_chars when it is
+// a control character, below ' '
+struct ChunkMasks {
+    uint32_t spaces = 0;
+    uint32_t control_chars = 0;
+};
+
+// Masks of the count <= TEXT_CHUNK_SIZE bytes at data. A full chunk is classified with
+// SSE2 where it is available
+ChunkMasks ClassifyChunk(const char* data, size_t count) {
+    ChunkMasks masks;
+#ifdef __SSE2__
+    if (count == TEXT_CHUNK_SIZE) {
+        const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+        // There is no unsigned byte comparison: a byte is at most 31 when min(byte, 31) is the byte
+        const __m128i control_chars = _mm_cmpeq_epi8(_mm_min_epu8(bytes, _mm_set1_epi8(' ' - 1)), bytes);
+        masks.spaces = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(' ')));
+        masks.control_chars = _mm_movemask_epi8(control_chars);
+        return masks;
+    }
+#endif
+    for (size_t i = 0; i < count; ++i) {
+        const unsigned char byte = data[i];
+        masks.spaces |= uint32_t{byte == ' '} << i;
+        masks.control_chars |= uint32_t{byte < ' '} << i;
+    }
+    return masks;
+}
+
+// Calls func(word) for the words of text in order, without collecting them. The same pass
+// looks for control characters: returns false if text has them, though after all words
+template <typename Func>
+bool ForEachWord(string_view text, Func func) {
+    uint32_t control_chars = 0;
+    // Start of the current word, npos between words
+    size_t word_begin = text.npos;
+    for (size_t chunk_begin = 0; chunk_begin < text.size(); chunk_begin += TEXT_CHUNK_SIZE) {
+        const size_t count = min(TEXT_CHUNK_SIZE, text.size() - chunk_begin);
+        const ChunkMasks masks = ClassifyChunk(text.data() + chunk_begin, count);
+        control_chars |= masks.control_chars;
+        const uint32_t chunk_bits = (uint32_t{1} << count) - 1;
+        // Bits of the bytes not yet passed
+        uint32_t left_bits = chunk_bits;
+        while (true) {
+            // Between words the next non-space byte starts a word, inside a word the next space ends it
+            const uint32_t boundaries = left_bits & (word_begin == text.npos ? ~masks.spaces : masks.spaces);
+            if (boundaries == 0) {
+                break;
             }
-        } else {
-            word += c;
+            const int offset = __builtin_ctz(boundaries);
+            if (word_begin == text.npos) {
+                word_begin = chunk_begin + offset;
+            } else {
+                func(text.substr(word_begin, chunk_begin + offset - word_begin));
+                word_begin = text.npos;
+            }
+            left_bits = chunk_bits & (~uint32_t{0} << offset);
         }
     }
-    if (!word.empty()) {
-        words.push_back(word);
+    if (word_begin != text.npos) {
+        func(text.substr(word_begin));
+    }
+    return control_chars == 0;
+}
+
+// A valid text has no control characters
+bool IsValidText(string_view text) {
+    for (size_t chunk_begin = 0; chunk_begin < text.size(); chunk_begin += TEXT_CHUNK_SIZE) {
+        if (ClassifyChunk(text.data() + chunk_begin, min(TEXT_CHUNK_SIZE, text.size() - chunk_begin)).control_chars) {
+            return false;
+        }
     }
+    return true;
+}
 
+// Words are views into text, so text must outlive them
+vector<string_view> SplitIntoWords(string_view text) {
+    vector<string_view> words;
+    ForEachWord(text, [&words](string_view word) { words.push_back(word); });
     return words;
 }
 
@@ -60,12 +163,35 @@ struct Document {
     int rating = 0;
 };
 
+// Orders search results: by relevance, then by rating, then by ID
+bool CompareDocuments(const Document& lhs, const Document& rhs) {
+    if (abs(lhs.relevance - rhs.relevance) < EPSILON) {
+        return lhs.rating > rhs.rating || (lhs.rating == rhs.rating && lhs.id < rhs.id);
+    } else {
+        return lhs.relevance > rhs.relevance;
+    }
+}
+
+// Document frequencies of words over a set of documents. Servers holding parts of one
+// corpus score their documents with the sum of their statistics
+struct CorpusStatistics {
+    int document_count = 0;
+    map<string, int, less<>> document_freqs;
+
+    void Add(const CorpusStatistics& other) {
+        document_count += other.document_count;
+        for (const auto& [word, document_freq] : other.document_freqs) {
+            document_freqs[word] += document_freq;
+        }
+    }
+};
+
 template <typename StringContainer>
-set<string> MakeUniqueNonEmptyStrings(const StringContainer& strings) {
-    set<string> non_empty_strings;
-    for (const string& str : strings) {
+set<string, less<>> MakeUniqueNonEmptyStrings(const StringContainer& strings) {
+    set<string, less<>> non_empty_strings;
+    for (const auto& str : strings) {
         if (!str.empty()) {
-            non_empty_strings.insert(str);
+            non_empty_strings.emplace(str);
         }
     }
     return non_empty_strings;
@@ -78,586 +204,6010 @@ enum class DocumentStatus {
     REMOVED,
 };
 
+// A document for SearchServer::AddDocuments; text must stay valid during the call
+struct DocumentRecord {
+    int id = 0;
+    string_view text;
+    DocumentStatus status = DocumentStatus::ACTUAL;
+    vector<int> ratings;
+};
+
+// Lets a search be abandoned: once Cancel is called or the deadline passes, the search stops
+// scoring and returns the best documents among those it has scored. One per search
+class SearchCancellation {
+public:
+    SearchCancellation() = default;
+
+    explicit SearchCancellation(chrono::steady_clock::time_point deadline)
+        : deadline_(deadline) {
+    }
+
+    // May be called from any thread
+    void Cancel() {
+        is_cancelled_.store(true, memory_order_relaxed);
+    }
+
+    // Checked by the search between documents
+    bool ShouldStop() const {
+        if (is_cancelled_.load(memory_order_relaxed) || chrono::steady_clock::now() >= deadline_) {
+            is_stopped_.store(true, memory_order_relaxed);
+        }
+        return is_stopped_.load(memory_order_relaxed);
+    }
+
+    // Whether the search was cut short, not just cancelled after it finished
+    bool IsStopped() const {
+        return is_stopped_.load(memory_order_relaxed);
+    }
+
+private:
+    atomic<bool> is_cancelled_ = false;
+    mutable atomic<bool> is_stopped_ = false;
+    chrono::steady_clock::time_point deadline_ = chrono::steady_clock::time_point::max();
+};
+
+// Result of SearchServer::FindTopDocumentsAsync
+struct SearchResult {
+    vector<Document> documents;
+    // False when the search was stopped before it scored all matching documents
+    bool is_complete = true;
+};
+
+// Read-only memory mapping of a whole file
+class MappedFile {
+public:
+    explicit MappedFile(const string& path) {
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw runtime_error("Cannot open file "s + path);
+        }
+        struct stat file_stat;
+        if (fstat(fd, &file_stat) != 0) {
+            ::close(fd);
+            throw runtime_error("Cannot read size of file "s + path);
+        }
+        size_ = file_stat.st_size;
+        void* data = size_ == 0 ? nullptr : mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (data == MAP_FAILED) {
+            throw runtime_error("Cannot map file "s + path);
+        }
+        data_ = static_cast<const char*>(data);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        if (data_) {
+            munmap(const_cast<char*>(data_), size_);
+        }
+    }
+
+    const char* GetData() const {
+        return data_;
+    }
+
+    size_t GetSize() const {
+        return size_;
+    }
+
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+// Prints how long the scope took when it ends
+class LogDuration {
+public:
+    using Clock = chrono::steady_clock;
+
+    explicit LogDuration(string_view id, ostream& output = cerr)
+        : id_(id)
+        , output_(output) {
+    }
+
+    LogDuration(const LogDuration&) = delete;
+    LogDuration& operator=(const LogDuration&) = delete;
+
+    ~LogDuration() {
+        const auto duration = chrono::duration_cast<chrono::milliseconds>(Clock::now() - start_time_);
+        output_ << id_ << ": "s << duration.count() << " ms"s << endl;
+    }
+
+private:
+    const string id_;
+    ostream& output_;
+    const Clock::time_point start_time_ = Clock::now();
+};
+
+#define PROFILE_CONCAT_INTERNAL(X, Y) X##Y
+#define PROFILE_CONCAT(X, Y) PROFILE_CONCAT_INTERNAL(X, Y)
+#define UNIQUE_VAR_NAME_PROFILE PROFILE_CONCAT(profile_guard_, __LINE__)
+#define LOG_DURATION(id) LogDuration UNIQUE_VAR_NAME_PROFILE(id)
+#define LOG_DURATION_STREAM(id, output) LogDuration UNIQUE_VAR_NAME_PROFILE(id, output)
+
+enum class SearchStage {
+    PARSE_QUERY,
+    EXCLUDE_MINUS_WORDS,
+    SCORE_DOCUMENTS,
+    SORT_RESULTS,
+};
+
+#ifdef SEARCH_SERVER_PROFILE
+using SearchCounter = uint64_t;
+#else
+// Counts nothing, so that the counting in the search loops compiles to nothing
+struct SearchCounter {
+    SearchCounter& operator++() {
+        return *this;
+    }
+
+    SearchCounter& operator+=(uint64_t) {
+        return *this;
+    }
+
+    operator uint64_t() const {
+        return 0;
+    }
+};
+#endif
+
+// What searches did, added up
+struct SearchCounts {
+    SearchCounter postings_visited{};
+    SearchCounter documents_scored{};
+    SearchCounter filtered_by_predicate{};
+    SearchCounter filtered_by_minus_words{};
+};
+
+// Durations of the search stages and the counts of the work done, collected from all threads
+// when the server is built with SEARCH_SERVER_PROFILE; otherwise every call compiles to nothing.
+// Minus words and scoring are measured per ordinal range, so once per shard in parallel searches
+#ifdef SEARCH_SERVER_PROFILE
+class SearchProfile {
+public:
+    static constexpr int STAGE_COUNT = static_cast<int>(SearchStage::SORT_RESULTS) + 1;
+    // Bucket i counts durations of at most 2^i microseconds, the last one all longer
+    static constexpr int BUCKET_COUNT = 25;
+
+    // Records the duration of the stage when it is stopped or destroyed, whichever is first
+    class StageTimer {
+    public:
+        StageTimer(SearchProfile& profile, SearchStage stage)
+            : profile_(&profile)
+            , stage_(stage) {
+        }
+
+        StageTimer(const StageTimer&) = delete;
+        StageTimer& operator=(const StageTimer&) = delete;
+
+        ~StageTimer() {
+            Stop();
+        }
+
+        void Stop() {
+            if (profile_) {
+                profile_->RecordStage(stage_, chrono::steady_clock::now() - start_time_);
+                profile_ = nullptr;
+            }
+        }
+
+    private:
+        SearchProfile* profile_;
+        SearchStage stage_;
+        chrono::steady_clock::time_point start_time_ = chrono::steady_clock::now();
+    };
+
+    StageTimer MeasureStage(SearchStage stage) {
+        return StageTimer(*this, stage);
+    }
+
+    void Add(const SearchCounts& counts) {
+        postings_visited_ += counts.postings_visited;
+        documents_scored_ += counts.documents_scored;
+        filtered_by_predicate_ += counts.filtered_by_predicate;
+        filtered_by_minus_words_ += counts.filtered_by_minus_words;
+    }
+
+    SearchCounts GetCounts() const {
+        return {postings_visited_, documents_scored_, filtered_by_predicate_, filtered_by_minus_words_};
+    }
+
+    uint64_t GetStageCount(SearchStage stage) const {
+        const auto& buckets = stage_buckets_[static_cast<int>(stage)];
+        return accumulate(buckets.begin(), buckets.end(), uint64_t{0});
+    }
+
+    // Prometheus text exposition format
+    void WriteMetrics(ostream& output) const {
+        static const array<string_view, STAGE_COUNT> stage_names = {
+            "parse_query"sv, "exclude_minus_words"sv, "score_documents"sv, "sort_results"sv};
+        const streamsize precision = output.precision(9);
+        output << "# TYPE search_stage_duration_seconds histogram\n"s;
+        for (int stage = 0; stage < STAGE_COUNT; ++stage) {
+            uint64_t count = 0;
+            for (int bucket = 0; bucket < BUCKET_COUNT; ++bucket) {
+                count += stage_buckets_[stage][bucket];
+                output << "search_stage_duration_seconds_bucket{stage=\""s << stage_names[stage] << "\",le=\""s;
+                if (bucket + 1 < BUCKET_COUNT) {
+                    output << (1 << bucket) * 1e-6;
+                } else {
+                    output << "+Inf"s;
+                }
+                output << "\"} "s << count << '\n';
+            }
+            output << "search_stage_duration_seconds_sum{stage=\""s << stage_names[stage] << "\"} "s
+                   << stage_nanoseconds_[stage] * 1e-9 << '\n';
+            output << "search_stage_duration_seconds_count{stage=\""s << stage_names[stage] << "\"} "s
+                   << count << '\n';
+        }
+        const SearchCounts counts = GetCounts();
+        output << "# TYPE search_postings_visited_total counter\n"s
+               << "search_postings_visited_total "s << counts.postings_visited << '\n'
+               << "# TYPE search_documents_scored_total counter\n"s
+               << "search_documents_scored_total "s << counts.documents_scored << '\n'
+               << "# TYPE search_documents_filtered_total counter\n"s
+               << "search_documents_filtered_total{by=\"predicate\"} "s << counts.filtered_by_predicate << '\n'
+               << "search_documents_filtered_total{by=\"minus_words\"} "s << counts.filtered_by_minus_words << '\n';
+        output.precision(precision);
+    }
+
+private:
+    array<array<atomic<uint64_t>, BUCKET_COUNT>, STAGE_COUNT> stage_buckets_{};
+    array<atomic<uint64_t>, STAGE_COUNT> stage_nanoseconds_{};
+    atomic<uint64_t> postings_visited_ = 0;
+    atomic<uint64_t> documents_scored_ = 0;
+    atomic<uint64_t> filtered_by_predicate_ = 0;
+    atomic<uint64_t> filtered_by_minus_words_ = 0;
+
+    void RecordStage(SearchStage stage, chrono::steady_clock::duration duration) {
+        const uint64_t nanoseconds = chrono::duration_cast<chrono::nanoseconds>(duration).count();
+        int bucket = 0;
+        while (bucket + 1 < BUCKET_COUNT && nanoseconds > (uint64_t{1000} << bucket)) {
+            ++bucket;
+        }
+        ++stage_buckets_[static_cast<int>(stage)][bucket];
+        stage_nanoseconds_[static_cast<int>(stage)] += nanoseconds;
+    }
+};
+#else
+class SearchProfile {
+public:
+    struct StageTimer {
+        void Stop() {
+        }
+    };
+
+    StageTimer MeasureStage(SearchStage) {
+        return {};
+    }
+
+    void Add(const SearchCounts&) {
+    }
+
+    SearchCounts GetCounts() const {
+        return {};
+    }
+
+    uint64_t GetStageCount(SearchStage) const {
+        return 0;
+    }
+
+    void WriteMetrics(ostream&) const {
+    }
+};
+#endif
+
 class SearchServer {
 public:
     SearchServer() = default;
     
     template <typename StringContainer>
-    explicit SearchServer(const StringContainer& stop_words)
-        : stop_words_(MakeUniqueNonEmptyStrings(stop_words)) {
-        for(const string& word : stop_words){
+    explicit SearchServer(const StringContainer& stop_words) {
+        for(const auto& word : stop_words){
             if(!IsValidWord(word)) throw invalid_argument("Bad constructors stop arguments"s);
         }
+        for (const string& word : MakeUniqueNonEmptyStrings(stop_words)) {
+            InternWord(word);
+        }
+        stop_word_count_ = terms_.GetTermCount();
     }
 
-    explicit SearchServer(const string& stop_words_text)
+    explicit SearchServer(string_view stop_words_text)
         : SearchServer(
             SplitIntoWords(stop_words_text))  // Invoke delegating constructor from string container
     {
     }
 
+    explicit SearchServer(const string& stop_words_text)
+        : SearchServer(string_view(stop_words_text)) {
+    }
+
+    // Word frequencies are keyed by views into terms_, so copies would point into the original
+    SearchServer(const SearchServer&) = delete;
+    SearchServer& operator=(const SearchServer&) = delete;
+    SearchServer(SearchServer&&) = default;
+
+    // ID of the index-th document in the order documents were added
     int GetDocumentId(int index) const {
         if(index >= 0 && index < GetDocumentCount()){
-            return ids_.at(index);
+            return ids_[live_ordinals_.FindNth(index)];
         }
         else {
             throw out_of_range("Wrong index of document"s);
         }
     }
 
-    void AddDocument(int document_id, const string& document, DocumentStatus status,
+    void AddDocument(int document_id, string_view document, DocumentStatus status,
                                    const vector<int>& ratings) {
-        if(documents_.count(document_id)) {
+        if(document_ordinals_.count(document_id)) {
             throw invalid_argument("Document ID is already exist"s);
         }
         if(document_id < 0) {
             throw invalid_argument("Document ID is negative"s);
         }
 
-        const vector<string> words = SplitIntoWordsNoStop(document);
+        const vector<string_view> words = SplitIntoWordsNoStop(document);
+        ++generation_;
 
+        const int ordinal = ids_.size();
         const double inv_word_count = 1.0 / words.size();
-        for (const string& word : words) {
-            word_to_document_freqs_[word][document_id] += inv_word_count;
+        map<string_view, int> word_counts;
+        for (const string_view word : words) {
+            ++word_counts[word];
         }
-        documents_.emplace(document_id, DocumentData{ComputeAverageRating(ratings), status});
+        map<string_view, double> indexed_word_freqs;
+        for (const auto& [word, term_count] : word_counts) {
+            const TermId term = InternWord(word);
+            word_data_[term].UpdateDocumentFreq(1);
+            active_segment_.term_postings[term].Add(ordinal, term_count);
+            indexed_word_freqs.emplace_hint(indexed_word_freqs.end(), terms_.GetWord(term), term_count * inv_word_count);
+        }
+        document_ordinals_.emplace(document_id, ordinal);
         ids_.push_back(document_id);
-    }
+        ratings_.push_back(ComputeAverageRating(ratings));
+        statuses_.push_back(status);
+        inv_word_counts_.push_back(inv_word_count);
+        AddStatusOrdinal(status, ordinal);
+        word_freqs_.push_back(move(indexed_word_freqs));
+        removed_.push_back(false);
+        live_ordinals_.PushBack();
+        UpdateLogDocumentCount();
 
-    template <typename DocumentPredicate>
-    vector<Document> FindTopDocuments(const string& raw_query, DocumentPredicate document_predicate) const {
-        if(!IsValidWord(raw_query)) {
-            throw invalid_argument("Invalid requests text"s);
-        }
-        if(raw_query.empty()) {
-            throw invalid_argument("Raw query is empty"s);
+        active_segment_.last_ordinal = ordinal + 1;
+        if (active_segment_.last_ordinal - active_segment_.first_ordinal >= ACTIVE_SEGMENT_DOCUMENT_COUNT) {
+            FreezeActiveSegment();
         }
+    }
 
-        const Query query = ParseQuery(raw_query);
-        
-        if(query.plus_words.empty() && query.minus_words.empty() && !query.stop_words.empty()) {
-            vector<Document> empty_str;
-            return empty_str;
+    // Blocks until the background merges finish and puts their results in place
+    void WaitForMerges() {
+        while (merged_segment_.valid()) {
+            InstallMergedSegment();
         }
+    }
 
-        vector<Document> result = FindAllDocuments(query, document_predicate);
-        sort(result.begin(), result.end(),
-             [](const Document& lhs, const Document& rhs) {
-                 if (abs(lhs.relevance - rhs.relevance) < EPSILON) {
-                     return lhs.rating > rhs.rating;
-                 } else {
-                     return lhs.relevance > rhs.relevance;
-                 }
-             });
-        if (result.size() > MAX_RESULT_DOCUMENT_COUNT) {
-            result.resize(MAX_RESULT_DOCUMENT_COUNT);
+    // Word frequencies of the document, empty for an unknown ID
+    const map<string_view, double>& GetWordFrequencies(int document_id) const {
+        static const map<string_view, double> empty_word_freqs;
+        const auto ordinal_it = document_ordinals_.find(document_id);
+        if (ordinal_it == document_ordinals_.end()) {
+            return empty_word_freqs;
         }
-        return result;
+        const int ordinal = ordinal_it->second;
+        if (ordinal < mapped_documents_.document_count) {
+            lock_guard guard(*word_freqs_mutex_);
+            if (word_freqs_[ordinal].empty()) {
+                ForEachDocumentWord(ordinal, [this, ordinal](string_view word, double term_freq) {
+                    word_freqs_[ordinal].emplace_hint(word_freqs_[ordinal].end(), word, term_freq);
+                });
+            }
+        }
+        return word_freqs_[ordinal];
     }
 
-    vector<Document> FindTopDocuments(const string& raw_query, DocumentStatus status) const {
-        return FindTopDocuments(
-            raw_query, [status](int document_id, DocumentStatus document_status, int rating) {
-                return document_status == status;
-            });
-    }
-    
-    vector<Document> FindTopDocuments(const string& raw_query) const {
-        return FindTopDocuments(raw_query, DocumentStatus::ACTUAL);
+    // Does nothing for an unknown ID. Takes O(W + log N) for a document of W words: only the
+    // document frequencies of its words are updated, and its postings are left in place as
+    // tombstones that queries skip and merges drop
+    template <typename ExecutionPolicy>
+    void RemoveDocument(ExecutionPolicy&& policy, int document_id) {
+        const auto ordinal_it = document_ordinals_.find(document_id);
+        if (ordinal_it == document_ordinals_.end()) {
+            return;
+        }
+        const int ordinal = ordinal_it->second;
+        ++generation_;
+
+        vector<WordData*> word_data;
+        ForEachDocumentWord(ordinal, [this, &word_data](string_view word, double) {
+            word_data.push_back(&word_data_[terms_.Find(word)]);
+        });
+        for_each(policy, word_data.begin(), word_data.end(), [](WordData* data) {
+            data->UpdateDocumentFreq(-1);
+        });
+
+        document_ordinals_.erase(ordinal_it);
+        status_ordinals_[static_cast<int>(statuses_[ordinal])].Remove(ordinal);
+        word_freqs_[ordinal].clear();
+        removed_[ordinal] = true;
+        live_ordinals_.Remove(ordinal);
+        UpdateLogDocumentCount();
     }
 
-    int GetDocumentCount() const {
-        return documents_.size();
+    void RemoveDocument(int document_id) {
+        RemoveDocument(execution::seq, document_id);
     }
 
-    tuple<vector<string>, DocumentStatus> MatchDocument(const string& raw_query, int document_id) const {
-        if(documents_.count(document_id) == 0) {
-            throw invalid_argument("Wrong document ID (it has no exist)"s);
+    // Writes the live documents in the binary layout of OpenIndex. Removed documents
+    // are left out, so the saved ordinals are dense again
+    void SaveIndex(const string& path) const {
+        vector<int> new_ordinals(ids_.size(), -1);
+        vector<int> ids;
+        vector<int> ratings;
+        vector<DocumentStatus> statuses;
+        vector<double> inv_word_counts;
+        for (size_t ordinal = 0; ordinal < ids_.size(); ++ordinal) {
+            if (!removed_[ordinal]) {
+                new_ordinals[ordinal] = ids.size();
+                ids.push_back(ids_[ordinal]);
+                ratings.push_back(ratings_[ordinal]);
+                statuses.push_back(statuses_[ordinal]);
+                inv_word_counts.push_back(inv_word_counts_[ordinal]);
+            }
         }
 
-        const Query query = ParseQuery(raw_query);
-        if(query.plus_words.empty() && query.minus_words.empty() && !query.stop_words.empty()) {
-            vector<string> empty_words;
-            return make_tuple(empty_words, DocumentStatus::ACTUAL);
+        vector<TermId> terms;
+        for (TermId term = 0; term < word_data_.size(); ++term) {
+            if (word_data_[term].document_freq > 0) {
+                terms.push_back(term);
+            }
         }
+        sort(terms.begin(), terms.end(), [this](TermId lhs, TermId rhs) {
+            return terms_.GetWord(lhs) < terms_.GetWord(rhs);
+        });
 
-        vector<string> matched_words;
-        for (const string& word : query.plus_words) {
-            if (word_to_document_freqs_.count(word) == 0) {
-                continue;
-            }
-            if (word_to_document_freqs_.at(word).count(document_id)) {
-                matched_words.push_back(word);
-            }
+        // The saved segment is keyed by the indexes of the words in the sorted word table,
+        // which become the term IDs of OpenIndex
+        SegmentBuilder builder(0, ids.size());
+        vector<uint64_t> document_word_offsets(ids.size() + 1, 0);
+        for (TermId word_index = 0; word_index < terms.size(); ++word_index) {
+            builder.StartWord(word_index);
+            ForEachTermCount(terms[word_index], 0, ids_.size(), [&](int ordinal, int term_count) {
+                builder.AddPosting(new_ordinals[ordinal], term_count, term_count * inv_word_counts_[ordinal]);
+                ++document_word_offsets[new_ordinals[ordinal] + 1];
+            });
         }
-        for (const string& word : query.minus_words) {
-            if (word_to_document_freqs_.count(word) == 0) {
-                continue;
-            }
-            if (word_to_document_freqs_.at(word).count(document_id)) {
-                matched_words.clear();
-                break;
-            }
+        const shared_ptr<const FrozenSegment> segment = builder.Build();
+
+        // The forward index lists the words of every document, in sorted order
+        partial_sum(document_word_offsets.begin(), document_word_offsets.end(), document_word_offsets.begin());
+        vector<uint64_t> document_word_ends(document_word_offsets.begin(), prev(document_word_offsets.end()));
+        vector<uint32_t> document_words(document_word_offsets.back());
+        vector<string_view> words;
+        for (size_t word_index = 0; word_index < segment->terms.size(); ++word_index) {
+            segment->GetPostings(word_index).ForEach(0, ids.size(), [&](int ordinal, int) {
+                document_words[document_word_ends[ordinal]++] = word_index;
+            });
+            words.push_back(terms_.GetWord(terms[segment->terms[word_index]]));
         }
-        return make_tuple(matched_words, documents_.at(document_id).status);
-    }
 
-private:
-    struct DocumentData {
-        int rating;
-        DocumentStatus status;
-    };
-    const set<string> stop_words_;
-    map<string, map<int, double>> word_to_document_freqs_;
-    map<int, DocumentData> documents_;
-    vector<int> ids_;
+        vector<string_view> stop_words;
+        for (TermId term = 0; term < stop_word_count_; ++term) {
+            stop_words.push_back(terms_.GetWord(term));
+        }
+        const vector<uint64_t> stop_word_char_offsets = ComputeCharOffsets(stop_words);
+        const vector<uint64_t> word_char_offsets = ComputeCharOffsets(words);
+        IndexFileHeader header;
+        memcpy(header.magic, INDEX_FILE_MAGIC, sizeof(header.magic));
+        header.stop_word_count = stop_words.size();
+        header.stop_word_chars = stop_word_char_offsets.back();
+        header.word_count = words.size();
+        header.word_chars = word_char_offsets.back();
+        header.block_count = segment->GetBlockCount();
+        header.posting_byte_count = segment->GetByteCount();
+        header.posting_count = document_words.size();
+        header.document_count = ids.size();
 
-    static bool IsValidWord(const string& word) {
-        // A valid word must not contain special characters
-        return none_of(word.begin(), word.end(), [](char c) {
-            return c >= '\0' && c < ' ';
-        });
+        // The file is written next to the old one and renamed over it, so processes that
+        // mapped the old file keep reading its pages instead of a truncated file
+        const string temporary_path = path + ".tmp"s;
+        ofstream out(temporary_path, ios::binary);
+        if (!out) {
+            throw runtime_error("Cannot create index file "s + temporary_path);
+        }
+        WriteArray(out, &header, 1);
+        WriteStrings(out, stop_words, stop_word_char_offsets);
+        WriteStrings(out, words, word_char_offsets);
+        WriteArray(out, segment->posting_counts, header.word_count);
+        WriteArray(out, segment->word_blocks, header.word_count + 1);
+        WriteArray(out, segment->block_first_ordinals, header.block_count);
+        WriteArray(out, segment->block_offsets, header.block_count + 1);
+        WriteArray(out, segment->block_max_term_freqs, header.block_count);
+        WriteArray(out, segment->posting_bytes, header.posting_byte_count);
+        WriteArray(out, ids.data(), ids.size());
+        WriteArray(out, ratings.data(), ratings.size());
+        WriteArray(out, statuses.data(), statuses.size());
+        WriteArray(out, inv_word_counts.data(), inv_word_counts.size());
+        WriteArray(out, document_word_offsets.data(), document_word_offsets.size());
+        WriteArray(out, document_words.data(), document_words.size());
+        out.close();
+        if (!out || !SyncFile(temporary_path) || rename(temporary_path.c_str(), path.c_str()) != 0) {
+            remove(temporary_path.c_str());
+            throw runtime_error("Cannot write index file "s + path);
+        }
     }
 
-    bool IsStopWord(const string& word) const {
-        return stop_words_.count(word) > 0;
-    }
+    // Maps a file written by SaveIndex. The postings are read straight from the mapped
+    // pages, so processes that open the same file share them in the page cache. Only the
+    // word dictionary and the document table are copied into memory
+    static SearchServer OpenIndex(const string& path) {
+        auto file = make_shared<const MappedFile>(path);
+        IndexFileReader reader(*file);
+        const IndexFileHeader& header = *reader.ReadArray<IndexFileHeader>(1);
+        if (memcmp(header.magic, INDEX_FILE_MAGIC, sizeof(header.magic)) != 0) {
+            throw invalid_argument("Wrong index file format"s);
+        }
+        // Every counted item takes at least a byte, so no count + 1 below overflows
+        for (const uint64_t count : {header.stop_word_count, header.stop_word_chars, header.word_count,
+                                     header.word_chars, header.block_count, header.posting_byte_count,
+                                     header.posting_count, header.document_count}) {
+            if (count >= file->GetSize()) {
+                throw invalid_argument("Wrong index file format"s);
+            }
+        }
+        if (header.document_count > static_cast<uint64_t>(numeric_limits<int>::max())) {
+            throw invalid_argument("Wrong index file format"s);
+        }
+        SearchServer server(reader.ReadStrings(header.stop_word_count, header.stop_word_chars));
 
-    vector<string> SplitIntoWordsNoStop(const string& text) const {
-        vector<string> words;
-        for (const string& word : SplitIntoWords(text)) {
-            if(!IsValidWord(word)){
-                throw invalid_argument("Invalid word try to add"s);
+        const int document_count = header.document_count;
+        auto segment = make_shared<FrozenSegment>();
+        segment->last_ordinal = document_count;
+        const vector<string_view> words = reader.ReadStrings(header.word_count, header.word_chars);
+        segment->posting_counts = reader.ReadArray<uint32_t>(header.word_count);
+        segment->word_blocks = reader.ReadArray<uint64_t>(header.word_count + 1);
+        segment->block_first_ordinals = reader.ReadArray<int>(header.block_count);
+        segment->block_offsets = reader.ReadArray<uint64_t>(header.block_count + 1);
+        segment->block_max_term_freqs = reader.ReadArray<double>(header.block_count);
+        segment->posting_bytes = reader.ReadArray<uint8_t>(header.posting_byte_count);
+        // Indexed words are distinct and never stop words, so they get increasing term IDs
+        segment->terms.reserve(words.size());
+        for (size_t word_index = 0; word_index < words.size(); ++word_index) {
+            const TermId expected_term = server.terms_.GetTermCount();
+            const TermId term = server.InternWord(words[word_index]);
+            if (term != expected_term) {
+                throw invalid_argument("Wrong index file format"s);
             }
-            if (!IsStopWord(word)) {
-                words.push_back(word);
+            segment->terms.push_back(term);
+            server.word_data_[term].UpdateDocumentFreq(segment->posting_counts[word_index]);
+        }
+        const int* ids = reader.ReadArray<int>(document_count);
+        const int* ratings = reader.ReadArray<int>(document_count);
+        const DocumentStatus* statuses = reader.ReadArray<DocumentStatus>(document_count);
+        const double* inv_word_counts = reader.ReadArray<double>(document_count);
+        server.mapped_documents_.word_offsets = reader.ReadArray<uint64_t>(document_count + 1);
+        server.mapped_documents_.words = reader.ReadArray<uint32_t>(header.posting_count);
+        if (!AreValidOffsets(segment->word_blocks, header.word_count, header.block_count)
+            || !AreValidOffsets(segment->block_offsets, header.block_count, header.posting_byte_count)
+            || !AreValidOffsets(server.mapped_documents_.word_offsets, document_count, header.posting_count)) {
+            throw invalid_argument("Wrong index file format"s);
+        }
+        for (size_t word_index = 0; word_index < header.word_count; ++word_index) {
+            const uint64_t posting_count = segment->posting_counts[word_index];
+            const uint64_t block_count = segment->word_blocks[word_index + 1] - segment->word_blocks[word_index];
+            if (posting_count > static_cast<uint64_t>(document_count)
+                || block_count != (posting_count + POSTING_BLOCK_SIZE - 1) / POSTING_BLOCK_SIZE) {
+                throw invalid_argument("Wrong index file format"s);
             }
         }
-        return words;
-    }
+        for (size_t block = 0; block < header.block_count; ++block) {
+            if (segment->block_first_ordinals[block] < 0 || segment->block_first_ordinals[block] >= document_count) {
+                throw invalid_argument("Wrong index file format"s);
+            }
+        }
+        for (size_t i = 0; i < header.posting_count; ++i) {
+            if (server.mapped_documents_.words[i] >= header.word_count) {
+                throw invalid_argument("Wrong index file format"s);
+            }
+        }
+        segment->storage = move(file);
 
-    static int ComputeAverageRating(const vector<int>& ratings) {
-        if (ratings.empty()) {
-            return 0;
+        server.ids_.assign(ids, ids + document_count);
+        server.ratings_.assign(ratings, ratings + document_count);
+        server.statuses_.assign(statuses, statuses + document_count);
+        server.inv_word_counts_.assign(inv_word_counts, inv_word_counts + document_count);
+        for (int ordinal = 0; ordinal < document_count; ++ordinal) {
+            if (ids[ordinal] < 0 || !server.document_ordinals_.emplace(ids[ordinal], ordinal).second
+                || static_cast<uint32_t>(statuses[ordinal]) > static_cast<uint32_t>(DocumentStatus::REMOVED)) {
+                throw invalid_argument("Wrong index file format"s);
+            }
+            server.live_ordinals_.PushBack();
+            server.AddStatusOrdinal(statuses[ordinal], ordinal);
         }
-        int rating_sum = 0;
-        for (const int rating : ratings) {
-            rating_sum += rating;
+        server.word_freqs_.resize(document_count);
+        server.removed_.assign(document_count, false);
+        server.UpdateLogDocumentCount();
+
+        server.mapped_documents_.document_count = document_count;
+        server.mapped_documents_.segment = segment;
+        if (document_count > 0) {
+            server.frozen_segments_.push_back(move(segment));
         }
-        return rating_sum / static_cast<int>(ratings.size());
+        server.active_segment_ = ActiveSegment{document_count, document_count, {}};
+        return server;
     }
 
-    struct QueryWord {
-        string data;
-        bool is_minus;
-        bool is_stop;
-    };
+    template <typename ExecutionPolicy, typename DocumentPredicate>
+    vector<Document> FindTopDocuments(ExecutionPolicy&& policy, string_view raw_query,
+                                      DocumentPredicate document_predicate,
+                                      size_t top_count = MAX_RESULT_DOCUMENT_COUNT) const {
+        return FindTopDocuments(policy, raw_query, document_predicate, top_count, SearchOptions{});
+    }
 
-    QueryWord ParseQueryWord(string text) const {
-        bool is_minus = false;
-        // Word shouldn't be empty
-        if (text[0] == '-') {
-            is_minus = true;
-            text = text.substr(1);
-        }
-        if (text.empty() || text[0] == '-' || !IsValidWord(text)) {
-            throw invalid_argument("Invalid word try to request"s);
-        }
-        return {text, is_minus, IsStopWord(text)};
+    // Scratch memory of the search is taken from resource. Shards of a parallel search
+    // run on other threads, which use their own arenas
+    template <typename ExecutionPolicy, typename DocumentPredicate>
+    vector<Document> FindTopDocuments(ExecutionPolicy&& policy, string_view raw_query,
+                                      DocumentPredicate document_predicate, size_t top_count,
+                                      pmr::memory_resource& resource) const {
+        SearchOptions options;
+        options.resource = &resource;
+        return FindTopDocuments(policy, raw_query, document_predicate, top_count, options);
     }
 
-    struct Query {
-        set<string> plus_words;
-        set<string> minus_words;
-        set<string> stop_words;
-    };
+    // Scores with the statistics of the whole corpus instead of the ones of this server
+    template <typename ExecutionPolicy, typename DocumentPredicate>
+    vector<Document> FindTopDocuments(ExecutionPolicy&& policy, string_view raw_query,
+                                      DocumentPredicate document_predicate, size_t top_count,
+                                      const CorpusStatistics& statistics) const {
+        SearchOptions options;
+        options.statistics = &statistics;
+        return FindTopDocuments(policy, raw_query, document_predicate, top_count, options);
+    }
 
-   Query ParseQuery(const string& text) const {
-        Query query;
-        for (const string& word : SplitIntoWords(text)) {
-            const QueryWord query_word = ParseQueryWord(word);
-            if(query_word.data.empty()) {
-                return {};
-            }
-            if (!query_word.is_stop) {
-                if (query_word.is_minus) {
-                    query.minus_words.insert(query_word.data);
-                } else {
-                    query.plus_words.insert(query_word.data);
-                }
+    // Document frequencies of the plus words of the query among the documents of this server
+    CorpusStatistics GetQueryStatistics(string_view raw_query) const {
+        CorpusStatistics statistics;
+        statistics.document_count = GetDocumentCount();
+        const QueryArena arena;
+        for (const TermId term : ParseQuery(raw_query, arena.GetResource()).plus_words) {
+            if (const WordData* word_data = FindWordData(term)) {
+                statistics.document_freqs.emplace(terms_.GetWord(term), word_data->document_freq);
             }
-            else query.stop_words.insert(word);
         }
-        return query;
+        return statistics;
     }
 
-    // Existence required
-    double ComputeWordInverseDocumentFreq(const string& word) const {
-        return log(GetDocumentCount() * 1.0 / word_to_document_freqs_.at(word).size());
-    }
+    // Adds the documents at once: they are tokenized in parallel, and every part of them gets
+    // its own frozen segment built from its own posting lists. If AddDocument would throw for
+    // one of the documents, the same exception is thrown for the first such document, and
+    // none of them is added
+    template <typename ExecutionPolicy, typename Documents>
+    void AddDocuments(ExecutionPolicy&& policy, const Documents& documents) {
+        vector<const DocumentRecord*> records;
+        for (const DocumentRecord& record : documents) {
+            records.push_back(&record);
+        }
+        const int document_count = records.size();
 
-    template <typename DocumentPredicate>
-    vector<Document> FindAllDocuments(const Query& query,
-                                      DocumentPredicate document_predicate) const {
-        map<int, double> document_to_relevance;
-        for (const string& word : query.plus_words) {
-            if (word_to_document_freqs_.count(word) == 0) {
-                continue;
+        vector<DocumentWords> document_words(document_count);
+        vector<exception_ptr> errors(document_count);
+        for_each(policy, records.begin(), records.end(), [&](const DocumentRecord* const& record) {
+            const size_t index = &record - records.data();
+            try {
+                document_words[index] = CountDocumentWords(record->text);
+            } catch (...) {
+                // Exceptions must not leave a parallel algorithm
+                errors[index] = current_exception();
             }
-            const double inverse_document_freq = ComputeWordInverseDocumentFreq(word);
-            for (const auto &[document_id, term_freq] : word_to_document_freqs_.at(word)) {
-                const auto& document_data = documents_.at(document_id);
-                if (document_predicate(document_id, document_data.status, document_data.rating)) {
-                    document_to_relevance[document_id] += term_freq * inverse_document_freq;
-                }
+        });
+        unordered_set<int> batch_ids;
+        batch_ids.reserve(document_count);
+        for (int index = 0; index < document_count; ++index) {
+            const int document_id = records[index]->id;
+            if (document_ordinals_.count(document_id) || batch_ids.count(document_id)) {
+                throw invalid_argument("Document ID is already exist"s);
             }
-        }
-
-        for (const string& word : query.minus_words) {
-            if (word_to_document_freqs_.count(word) == 0) {
-                continue;
+            if (document_id < 0) {
+                throw invalid_argument("Document ID is negative"s);
             }
-            for (const auto &[document_id, _] : word_to_document_freqs_.at(word)) {
-                document_to_relevance.erase(document_id);
+            if (errors[index]) {
+                rethrow_exception(errors[index]);
             }
+            batch_ids.insert(document_id);
         }
 
+        // Segments smaller than the active one would only add merges
+        if (document_count < ACTIVE_SEGMENT_DOCUMENT_COUNT) {
+            for (const DocumentRecord* record : records) {
+                AddDocument(record->id, record->text, record->status, record->ratings);
+            }
+            return;
+        }
+        if (active_segment_.last_ordinal > active_segment_.first_ordinal) {
+            FreezeActiveSegment();
+        }
+        AddTokenizedDocuments(policy, records, document_words);
+    }
+
+    template <typename Documents>
+    void AddDocuments(const Documents& documents) {
+        AddDocuments(execution::par, documents);
+    }
+
+    // Only the documents of the status are visited, instead of checking the status of every match.
+    // The results are cached when the query cache is enabled
+    template <typename ExecutionPolicy>
+    vector<Document> FindTopDocuments(ExecutionPolicy&& policy, string_view raw_query, DocumentStatus status,
+                                      size_t top_count = MAX_RESULT_DOCUMENT_COUNT) const {
+        SearchOptions options;
+        options.cached_status = status;
+        return FindTopDocuments(policy, raw_query, StatusPredicate{status}, top_count, options);
+    }
+
+    // The status overload scoring with the statistics of the whole corpus
+    template <typename ExecutionPolicy>
+    vector<Document> FindTopDocuments(ExecutionPolicy&& policy, string_view raw_query, DocumentStatus status,
+                                      size_t top_count, const CorpusStatistics& statistics) const {
+        SearchOptions options;
+        options.statistics = &statistics;
+        return FindTopDocuments(policy, raw_query, StatusPredicate{status}, top_count, options);
+    }
+
+    // Keeps the results of the capacity most recently used status queries until the index
+    // changes; 0 disables the cache. Queries with a predicate are never cached
+    void SetQueryCacheCapacity(size_t capacity) {
+        query_cache_ = capacity == 0 ? nullptr : make_unique<QueryCache>(capacity);
+    }
+
+    // Starts thread_count threads for FindTopDocumentsAsync, with room for queue_capacity waiting
+    // queries; 0 threads stop them. The queued queries are run before the threads stop. They
+    // refer to the server, so it must not be moved while the threads run, and like concurrent
+    // FindTopDocuments calls they must not overlap with changes of the index
+    void SetQueryThreads(size_t thread_count, size_t queue_capacity) {
+        query_threads_ = nullptr;
+        if (thread_count > 0) {
+            query_threads_ = make_unique<QueryThreads>(thread_count, queue_capacity);
+        }
+    }
+
+    // Queues the search for the query threads and returns at once; raw_query is copied. The
+    // search stops early once the cancellation says so. When the queue is full, the future
+    // holds runtime_error, as it holds the exceptions of the search itself
+    template <typename DocumentPredicate>
+    future<SearchResult> FindTopDocumentsAsync(string_view raw_query, DocumentPredicate document_predicate,
+                                               size_t top_count = MAX_RESULT_DOCUMENT_COUNT,
+                                               shared_ptr<const SearchCancellation> cancellation = nullptr) const {
+        return SubmitSearch(raw_query, document_predicate, top_count, SearchOptions{}, move(cancellation));
+    }
+
+    future<SearchResult> FindTopDocumentsAsync(string_view raw_query, DocumentStatus status = DocumentStatus::ACTUAL,
+                                               size_t top_count = MAX_RESULT_DOCUMENT_COUNT,
+                                               shared_ptr<const SearchCancellation> cancellation = nullptr) const {
+        SearchOptions options;
+        options.cached_status = status;
+        return SubmitSearch(raw_query, StatusPredicate{status}, top_count, options, move(cancellation));
+    }
+
+    // Empty unless the server is built with SEARCH_SERVER_PROFILE
+    const SearchProfile& GetProfile() const {
+        return *profile_;
+    }
+
+    size_t GetQueryCacheHitCount() const {
+        return query_cache_ ? query_cache_->GetHitCount() : 0;
+    }
+
+    size_t GetQueryCacheMissCount() const {
+        return query_cache_ ? query_cache_->GetMissCount() : 0;
+    }
+
+    template <typename ExecutionPolicy>
+    vector<Document> FindTopDocuments(ExecutionPolicy&& policy, string_view raw_query) const {
+        return FindTopDocuments(policy, raw_query, DocumentStatus::ACTUAL);
+    }
+
+    template <typename DocumentPredicate>
+    vector<Document> FindTopDocuments(string_view raw_query, DocumentPredicate document_predicate,
+                                      size_t top_count = MAX_RESULT_DOCUMENT_COUNT) const {
+        return FindTopDocuments(execution::seq, raw_query, document_predicate, top_count);
+    }
+
+    vector<Document> FindTopDocuments(string_view raw_query, DocumentStatus status,
+                                      size_t top_count = MAX_RESULT_DOCUMENT_COUNT) const {
+        return FindTopDocuments(execution::seq, raw_query, status, top_count);
+    }
+    
+    vector<Document> FindTopDocuments(string_view raw_query) const {
+        return FindTopDocuments(execution::seq, raw_query);
+    }
+
+    int GetDocumentCount() const {
+        return document_ordinals_.size();
+    }
+
+    // Bytes taken by the posting lists of all segments, without the word dictionary
+    size_t GetPostingMemoryUsage() const {
+        size_t result = 0;
+        for (const shared_ptr<const FrozenSegment>& segment : frozen_segments_) {
+            result += segment->terms.size() * (sizeof(uint32_t) + sizeof(uint64_t))
+                + segment->GetBlockCount() * (sizeof(int) + sizeof(uint64_t) + sizeof(double))
+                + segment->GetByteCount();
+        }
+        for (const auto& [term, postings] : active_segment_.term_postings) {
+            result += postings.ordinals.capacity() * sizeof(int) + postings.term_counts.capacity() * sizeof(int);
+        }
+        return result;
+    }
+
+    // Matched words are views into the index and stay valid while the server exists
+    template <typename ExecutionPolicy>
+    tuple<vector<string_view>, DocumentStatus> MatchDocument(ExecutionPolicy&& policy, string_view raw_query,
+                                                             int document_id) const {
+        const QueryArena arena;
+        return MatchDocument(policy, raw_query, document_id, *arena.GetResource());
+    }
+
+    // The parsed query is kept in memory taken from resource
+    template <typename ExecutionPolicy>
+    tuple<vector<string_view>, DocumentStatus> MatchDocument(ExecutionPolicy&& policy, string_view raw_query,
+                                                             int document_id, pmr::memory_resource& resource) const {
+        const auto ordinal_it = document_ordinals_.find(document_id);
+        if(ordinal_it == document_ordinals_.end()) {
+            throw invalid_argument("Wrong document ID (it has no exist)"s);
+        }
+        const int ordinal = ordinal_it->second;
+
+        const Query query = ParseQuery(raw_query, &resource);
+        if(query.plus_words.empty() && query.minus_words.empty() && query.has_stop_words) {
+            vector<string_view> empty_words;
+            return make_tuple(empty_words, DocumentStatus::ACTUAL);
+        }
+
+        const auto find_in_document = [this, ordinal](TermId term) {
+            return FindIndexedWord(term, ordinal);
+        };
+        vector<string_view> matched_words;
+        if (any_of(policy, query.minus_words.begin(), query.minus_words.end(),
+                   [&find_in_document](TermId term) { return !find_in_document(term).empty(); })) {
+            return make_tuple(matched_words, statuses_[ordinal]);
+        }
+        matched_words.resize(query.plus_words.size());
+        transform(policy, query.plus_words.begin(), query.plus_words.end(), matched_words.begin(),
+                  find_in_document);
+        matched_words.erase(remove(matched_words.begin(), matched_words.end(), string_view{}),
+                            matched_words.end());
+        return make_tuple(matched_words, statuses_[ordinal]);
+    }
+
+    tuple<vector<string_view>, DocumentStatus> MatchDocument(string_view raw_query, int document_id) const {
+        return MatchDocument(execution::seq, raw_query, document_id);
+    }
+
+private:
+    // Number of ordinal ranges a parallel query is split into
+    static constexpr int PARALLEL_SHARD_COUNT = 64;
+    // Documents the active segment takes before it is frozen
+    static constexpr int ACTIVE_SEGMENT_DOCUMENT_COUNT = 4096;
+    // Postings in a compressed block; a lookup decodes at most one block
+    static constexpr size_t POSTING_BLOCK_SIZE = 128;
+    static constexpr int END_ORDINAL = numeric_limits<int>::max();
+    // Candidates a search scores between the checks whether it is cancelled
+    static constexpr size_t STOP_CHECK_INTERVAL = 256;
+
+    // Words are numbered by the term dictionary in the order they are first seen
+    using TermId = uint32_t;
+    static constexpr TermId NO_TERM = numeric_limits<TermId>::max();
+
+    // Postings of one word in the active segment: ordinals in increasing order and the number
+    // of times the word occurs in each document. A term frequency is the count times the
+    // inverse word count of the document, so it does not take space in postings
+    struct PostingsView {
+        const int* ordinals = nullptr;
+        const int* term_counts = nullptr;
+        size_t size = 0;
+
+        // Calls func(ordinal, term_count) for the postings with ordinals in [first_ordinal, last_ordinal)
+        template <typename Func>
+        void ForEach(int first_ordinal, int last_ordinal, Func func) const {
+            const int* first = lower_bound(ordinals, ordinals + size, first_ordinal);
+            for (const int* it = first; it != ordinals + size && *it < last_ordinal; ++it) {
+                func(*it, term_counts[it - ordinals]);
+            }
+        }
+
+        // Zero if the document does not contain the word
+        int FindTermCount(int ordinal) const {
+            const int* it = lower_bound(ordinals, ordinals + size, ordinal);
+            return it != ordinals + size && *it == ordinal ? term_counts[it - ordinals] : 0;
+        }
+    };
+
+    struct PostingList {
+        vector<int> ordinals;
+        vector<int> term_counts;
+
+        // Ordinals are assigned in increasing order, so postings are only appended
+        void Add(int ordinal, int term_count) {
+            ordinals.push_back(ordinal);
+            term_counts.push_back(term_count);
+        }
+
+        PostingsView GetView() const {
+            return {ordinals.data(), term_counts.data(), ordinals.size()};
+        }
+    };
+
+    // New documents go to the active segment; when it is full it becomes frozen
+    struct ActiveSegment {
+        int first_ordinal = 0;
+        int last_ordinal = 0;
+        unordered_map<TermId, PostingList> term_postings;
+
+        PostingsView FindPostings(TermId term) const {
+            const auto it = term_postings.find(term);
+            return it == term_postings.end() ? PostingsView{} : it->second.GetView();
+        }
+    };
+
+    // Postings of one word in a frozen segment, compressed in blocks of POSTING_BLOCK_SIZE.
+    // A block stores its first ordinal apart, so that blocks can be skipped. Every posting
+    // is a varint of the ordinal delta shifted left by one, with the low bit set when the
+    // term count is not 1 and follows as another varint. The first delta of a block is zero
+    struct CompressedPostings {
+        const int* block_first_ordinals = nullptr;
+        // Block i takes bytes [block_offsets[i], block_offsets[i + 1])
+        const uint64_t* block_offsets = nullptr;
+        const double* block_max_term_freqs = nullptr;
+        const uint8_t* bytes = nullptr;
+        size_t size = 0;
+
+        size_t GetBlockCount() const {
+            return (size + POSTING_BLOCK_SIZE - 1) / POSTING_BLOCK_SIZE;
+        }
+
+        template <typename Func>
+        void ForEach(int first_ordinal, int last_ordinal, Func func) const {
+            const size_t block_count = GetBlockCount();
+            size_t block = upper_bound(block_first_ordinals, block_first_ordinals + block_count, first_ordinal)
+                - block_first_ordinals;
+            for (block = block == 0 ? 0 : block - 1; block < block_count; ++block) {
+                int ordinal = block_first_ordinals[block];
+                if (ordinal >= last_ordinal) {
+                    return;
+                }
+                const uint8_t* data = bytes + block_offsets[block];
+                const size_t block_size = min(POSTING_BLOCK_SIZE, size - block * POSTING_BLOCK_SIZE);
+                for (size_t i = 0; i < block_size; ++i) {
+                    const uint32_t delta = ReadVarint(data);
+                    ordinal += delta >> 1;
+                    const int term_count = delta & 1 ? ReadVarint(data) : 1;
+                    if (ordinal >= last_ordinal) {
+                        return;
+                    }
+                    if (ordinal >= first_ordinal) {
+                        func(ordinal, term_count);
+                    }
+                }
+            }
+        }
+
+        int FindTermCount(int ordinal) const {
+            int result = 0;
+            ForEach(ordinal, ordinal + 1, [&result](int, int term_count) {
+                result = term_count;
+            });
+            return result;
+        }
+    };
+
+    // Reads CompressedPostings in the order of ordinals, decoding one block at a time
+    class PostingCursor {
+    public:
+        explicit PostingCursor(const CompressedPostings& postings)
+            : postings_(postings)
+            , block_count_(postings.GetBlockCount()) {
+            DecodeBlock(0);
+        }
+
+        // END_ORDINAL after the last posting
+        int GetOrdinal() const {
+            return position_ < block_size_ ? ordinals_[position_] : END_ORDINAL;
+        }
+
+        int GetTermCount() const {
+            return term_counts_[position_];
+        }
+
+        void Next() {
+            if (++position_ == block_size_ && block_ + 1 < block_count_) {
+                DecodeBlock(block_ + 1);
+            }
+        }
+
+        // Moves to the first posting with an ordinal not less than target
+        void Advance(int target) {
+            if (GetOrdinal() >= target) {
+                return;
+            }
+            const size_t block = FindBlock(target);
+            if (block != block_) {
+                DecodeBlock(block);
+            }
+            while (GetOrdinal() < target) {
+                Next();
+            }
+        }
+
+        double GetMaxTermFreq() const {
+            return *max_element(postings_.block_max_term_freqs, postings_.block_max_term_freqs + block_count_);
+        }
+
+        // Bound of the term frequency of the posting with ordinal target, which must
+        // not be behind the postings already passed
+        double GetBlockMaxTermFreq(int target) const {
+            const int ordinal = GetOrdinal();
+            if (ordinal > target) {
+                return 0.0;
+            }
+            return postings_.block_max_term_freqs[ordinal == target ? block_ : FindBlock(target)];
+        }
+
+    private:
+        CompressedPostings postings_;
+        size_t block_count_;
+        size_t block_ = 0;
+        size_t block_size_ = 0;
+        size_t position_ = 0;
+        int ordinals_[POSTING_BLOCK_SIZE];
+        int term_counts_[POSTING_BLOCK_SIZE];
+
+        // The last block that starts not after target, searched from the current one
+        size_t FindBlock(int target) const {
+            const int* block_first_ordinals = postings_.block_first_ordinals;
+            return upper_bound(block_first_ordinals + block_ + 1, block_first_ordinals + block_count_, target)
+                - block_first_ordinals - 1;
+        }
+
+        void DecodeBlock(size_t block) {
+            block_ = block;
+            position_ = 0;
+            block_size_ = block < block_count_ ? min(POSTING_BLOCK_SIZE, postings_.size - block * POSTING_BLOCK_SIZE) : 0;
+            if (block_size_ == 0) {
+                return;
+            }
+            const uint8_t* data = postings_.bytes + postings_.block_offsets[block];
+            int ordinal = postings_.block_first_ordinals[block];
+            for (size_t i = 0; i < block_size_; ++i) {
+                const uint32_t delta = ReadVarint(data);
+                ordinal += delta >> 1;
+                ordinals_[i] = ordinal;
+                term_counts_[i] = delta & 1 ? ReadVarint(data) : 1;
+            }
+        }
+    };
+
+    // Postings of the documents with ordinals in [first_ordinal, last_ordinal).
+    // Frozen segments never change and are merged in the background. The postings
+    // of all words are stored back to back, in the order of the term IDs
+    struct FrozenSegment {
+        int first_ordinal = 0;
+        int last_ordinal = 0;
+        // Sorted
+        vector<TermId> terms;
+        const uint32_t* posting_counts = nullptr;
+        // Blocks of terms[i] are [word_blocks[i], word_blocks[i + 1])
+        const uint64_t* word_blocks = nullptr;
+        const int* block_first_ordinals = nullptr;
+        const uint64_t* block_offsets = nullptr;
+        const double* block_max_term_freqs = nullptr;
+        const uint8_t* posting_bytes = nullptr;
+        // Owns the arrays above: vectors of a SegmentBuilder or pages of a mapped index file
+        shared_ptr<const void> storage;
+
+        int GetOrdinalCount() const {
+            return last_ordinal - first_ordinal;
+        }
+
+        size_t GetBlockCount() const {
+            return word_blocks[terms.size()];
+        }
+
+        size_t GetByteCount() const {
+            return block_offsets[GetBlockCount()];
+        }
+
+        CompressedPostings FindPostings(TermId term) const {
+            const auto it = lower_bound(terms.begin(), terms.end(), term);
+            if (it == terms.end() || *it != term) {
+                return {};
+            }
+            return GetPostings(it - terms.begin());
+        }
+
+        CompressedPostings GetPostings(size_t index) const {
+            const uint64_t first_block = word_blocks[index];
+            return {block_first_ordinals + first_block, block_offsets + first_block,
+                    block_max_term_freqs + first_block, posting_bytes, posting_counts[index]};
+        }
+    };
+
+    // Builds a frozen segment in memory
+    class SegmentBuilder {
+    public:
+        SegmentBuilder(int first_ordinal, int last_ordinal) {
+            segment_.first_ordinal = first_ordinal;
+            segment_.last_ordinal = last_ordinal;
+        }
+
+        void Reserve(size_t word_count, size_t block_count, size_t byte_count) {
+            segment_.terms.reserve(word_count);
+            storage_->posting_counts.reserve(word_count);
+            storage_->word_blocks.reserve(word_count + 1);
+            storage_->block_first_ordinals.reserve(block_count);
+            storage_->block_offsets.reserve(block_count + 1);
+            storage_->block_max_term_freqs.reserve(block_count);
+            storage_->bytes.reserve(byte_count);
+        }
+
+        // Terms must come in increasing order; postings of the same term are appended to the
+        // previous ones. Postings of documents marked in removed are skipped. Both removed
+        // and inv_word_counts start at the first ordinal of the segment
+        template <typename Postings>
+        void AppendPostings(TermId term, const Postings& postings, const vector<bool>& removed,
+                            const double* inv_word_counts) {
+            StartWord(term);
+            postings.ForEach(segment_.first_ordinal, segment_.last_ordinal, [&](int ordinal, int term_count) {
+                const int index = ordinal - segment_.first_ordinal;
+                if (!removed[index]) {
+                    AddPosting(ordinal, term_count, term_count * inv_word_counts[index]);
+                }
+            });
+        }
+
+        void StartWord(TermId term) {
+            if (!segment_.terms.empty() && segment_.terms.back() == term) {
+                return;
+            }
+            DropEmptyWord();
+            segment_.terms.push_back(term);
+            storage_->posting_counts.push_back(0);
+            storage_->word_blocks.push_back(storage_->block_first_ordinals.size());
+        }
+
+        // Ordinals of a word must increase
+        void AddPosting(int ordinal, int term_count, double term_freq) {
+            uint32_t& posting_count = storage_->posting_counts.back();
+            if (posting_count % POSTING_BLOCK_SIZE == 0) {
+                storage_->block_first_ordinals.push_back(ordinal);
+                storage_->block_offsets.push_back(storage_->bytes.size());
+                storage_->block_max_term_freqs.push_back(0.0);
+                last_ordinal_ = ordinal;
+            }
+            storage_->block_max_term_freqs.back() = max(storage_->block_max_term_freqs.back(), term_freq);
+            const uint32_t delta = static_cast<uint32_t>(ordinal - last_ordinal_) << 1;
+            WriteVarint(storage_->bytes, term_count == 1 ? delta : delta | 1);
+            if (term_count != 1) {
+                WriteVarint(storage_->bytes, term_count);
+            }
+            last_ordinal_ = ordinal;
+            ++posting_count;
+        }
+
+        shared_ptr<const FrozenSegment> Build() {
+            DropEmptyWord();
+            storage_->word_blocks.push_back(storage_->block_first_ordinals.size());
+            storage_->block_offsets.push_back(storage_->bytes.size());
+            // The reserved sizes are estimates, and frozen segments live long
+            storage_->block_first_ordinals.shrink_to_fit();
+            storage_->block_offsets.shrink_to_fit();
+            storage_->block_max_term_freqs.shrink_to_fit();
+            storage_->bytes.shrink_to_fit();
+            segment_.posting_counts = storage_->posting_counts.data();
+            segment_.word_blocks = storage_->word_blocks.data();
+            segment_.block_first_ordinals = storage_->block_first_ordinals.data();
+            segment_.block_offsets = storage_->block_offsets.data();
+            segment_.block_max_term_freqs = storage_->block_max_term_freqs.data();
+            segment_.posting_bytes = storage_->bytes.data();
+            segment_.storage = move(storage_);
+            return make_shared<const FrozenSegment>(move(segment_));
+        }
+
+    private:
+        struct Storage {
+            vector<uint32_t> posting_counts;
+            vector<uint64_t> word_blocks;
+            vector<int> block_first_ordinals;
+            vector<uint64_t> block_offsets;
+            vector<double> block_max_term_freqs;
+            vector<uint8_t> bytes;
+        };
+
+        FrozenSegment segment_;
+        shared_ptr<Storage> storage_ = make_shared<Storage>();
+        int last_ordinal_ = 0;
+
+        // A word all postings of which were removed is not stored
+        void DropEmptyWord() {
+            if (!segment_.terms.empty() && storage_->posting_counts.back() == 0) {
+                segment_.terms.pop_back();
+                storage_->posting_counts.pop_back();
+                storage_->word_blocks.pop_back();
+            }
+        }
+    };
+
+    static void WriteVarint(vector<uint8_t>& bytes, uint32_t value) {
+        while (value >= 0x80) {
+            bytes.push_back(static_cast<uint8_t>(value) | 0x80);
+            value >>= 7;
+        }
+        bytes.push_back(value);
+    }
+
+    static uint32_t ReadVarint(const uint8_t*& data) {
+        uint32_t value = *data++;
+        if (value < 0x80) {
+            return value;
+        }
+        value &= 0x7f;
+        for (int shift = 7;; shift += 7) {
+            const uint32_t byte = *data++;
+            value |= (byte & 0x7f) << shift;
+            if (byte < 0x80) {
+                return value;
+            }
+        }
+    }
+
+    // Documents loaded by OpenIndex, with ordinals [0, document_count) of the mapped segment
+    struct MappedDocuments {
+        shared_ptr<const FrozenSegment> segment;
+        // Words of a document are segment->terms[words[i]] for i in [word_offsets[ordinal],
+        // word_offsets[ordinal + 1])
+        const uint64_t* word_offsets = nullptr;
+        const uint32_t* words = nullptr;
+        int document_count = 0;
+    };
+
+    // The index file is this header followed by arrays in the order SaveIndex writes them,
+    // each padded to 8 bytes. Numbers are stored in the byte order of the machine
+    struct IndexFileHeader {
+        char magic[8];
+        uint64_t stop_word_count;
+        uint64_t stop_word_chars;
+        uint64_t word_count;
+        uint64_t word_chars;
+        uint64_t block_count;
+        uint64_t posting_byte_count;
+        uint64_t posting_count;
+        uint64_t document_count;
+    };
+
+    static constexpr char INDEX_FILE_MAGIC[8] = {'S', 'R', 'C', 'H', 'I', 'D', 'X', '3'};
+    static_assert(sizeof(int) == 4 && sizeof(DocumentStatus) == sizeof(int), "Index file stores 32-bit ints");
+
+    // Hands out the consecutive arrays of a mapped index file
+    class IndexFileReader {
+    public:
+        explicit IndexFileReader(const MappedFile& file)
+            : position_(file.GetData())
+            , end_(file.GetData() + file.GetSize()) {
+        }
+
+        template <typename T>
+        const T* ReadArray(uint64_t count) {
+            const size_t left = end_ - position_;
+            if (count > left / sizeof(T)) {
+                throw invalid_argument("Index file is truncated"s);
+            }
+            const T* data = reinterpret_cast<const T*>(position_);
+            position_ += min(left, AlignSize(count * sizeof(T)));
+            return data;
+        }
+
+        // A string table is the offsets of the strings in its chars, then the chars
+        vector<string_view> ReadStrings(uint64_t count, uint64_t char_count) {
+            const uint64_t* offsets = ReadArray<uint64_t>(count + 1);
+            const char* chars = ReadArray<char>(char_count);
+            if (!AreValidOffsets(offsets, count, char_count)) {
+                throw invalid_argument("Wrong index file format"s);
+            }
+            vector<string_view> strings;
+            strings.reserve(count);
+            for (uint64_t i = 0; i < count; ++i) {
+                strings.emplace_back(chars + offsets[i], offsets[i + 1] - offsets[i]);
+            }
+            return strings;
+        }
+
+    private:
+        const char* position_;
+        const char* end_;
+    };
+
+    // An offset table of count items starts at zero, never decreases and ends at size
+    static bool AreValidOffsets(const uint64_t* offsets, uint64_t count, uint64_t size) {
+        return offsets[0] == 0 && offsets[count] == size && is_sorted(offsets, offsets + count + 1);
+    }
+
+    static bool SyncFile(const string& path) {
+        const int fd = ::open(path.c_str(), O_WRONLY);
+        if (fd < 0) {
+            return false;
+        }
+        const bool is_synced = fsync(fd) == 0;
+        return ::close(fd) == 0 && is_synced;
+    }
+
+    static size_t AlignSize(size_t size) {
+        return (size + 7) / 8 * 8;
+    }
+
+    template <typename T>
+    static void WriteArray(ostream& out, const T* data, size_t count) {
+        out.write(reinterpret_cast<const char*>(data), count * sizeof(T));
+        WritePadding(out, count * sizeof(T));
+    }
+
+    static void WritePadding(ostream& out, size_t size) {
+        static const char padding[8] = {};
+        out.write(padding, AlignSize(size) - size);
+    }
+
+    static vector<uint64_t> ComputeCharOffsets(const vector<string_view>& strings) {
+        vector<uint64_t> offsets(1, 0);
+        for (const string_view str : strings) {
+            offsets.push_back(offsets.back() + str.size());
+        }
+        return offsets;
+    }
+
+    static void WriteStrings(ostream& out, const vector<string_view>& strings, const vector<uint64_t>& offsets) {
+        WriteArray(out, offsets.data(), offsets.size());
+        for (const string_view str : strings) {
+            out.write(str.data(), str.size());
+        }
+        WritePadding(out, offsets.back());
+    }
+
+    // Interns every distinct word once: the chars go to an arena of blocks that never move,
+    // and the word gets the next term ID. The word is hashed once per lookup; the index and
+    // the parsed queries work with the IDs from then on
+    class TermDictionary {
+    public:
+        // NO_TERM for a word that was never interned
+        TermId Find(string_view word) const {
+            const auto it = ids_.find(word);
+            return it == ids_.end() ? NO_TERM : it->second;
+        }
+
+        TermId Intern(string_view word) {
+            if (const TermId term = Find(word); term != NO_TERM) {
+                return term;
+            }
+            if (terms_.size() == NO_TERM) {
+                throw length_error("Too many distinct words"s);
+            }
+            const TermId term = terms_.size();
+            terms_.push_back(CopyToArena(word));
+            ids_.emplace(terms_.back(), term);
+            return term;
+        }
+
+        // Stays valid while the dictionary exists
+        string_view GetWord(TermId term) const {
+            return terms_[term];
+        }
+
+        size_t GetTermCount() const {
+            return terms_.size();
+        }
+
+    private:
+        static constexpr size_t BLOCK_SIZE = 64 * 1024;
+
+        vector<unique_ptr<char[]>> blocks_;
+        char* block_position_ = nullptr;
+        size_t block_left_ = 0;
+        // Views into blocks_, indexed by the term ID
+        vector<string_view> terms_;
+        unordered_map<string_view, TermId> ids_;
+
+        string_view CopyToArena(string_view word) {
+            if (word.size() > block_left_) {
+                // A longer word gets a block of its own
+                const size_t block_size = max(BLOCK_SIZE, word.size());
+                blocks_.push_back(make_unique<char[]>(block_size));
+                block_position_ = blocks_.back().get();
+                block_left_ = block_size;
+            }
+            copy(word.begin(), word.end(), block_position_);
+            const string_view result(block_position_, word.size());
+            block_position_ += word.size();
+            block_left_ -= word.size();
+            return result;
+        }
+    };
+
+    // Corpus-wide statistics of an indexed word
+    struct WordData {
+        int document_freq = 0;
+        // Cached log of document_freq, see ComputeWordInverseDocumentFreq
+        double log_document_freq = 0.0;
+
+        void UpdateDocumentFreq(int delta) {
+            document_freq += delta;
+            log_document_freq = document_freq == 0 ? 0.0 : log(document_freq);
+        }
+    };
+
+    // Set of ordinals in the manner of roaring bitmaps: ordinals are split into chunks of
+    // 2^16 by their high bits, and a chunk keeps the sorted array of its low bits while it
+    // is sparse and switches to a bitmap once the array would take more space
+    class OrdinalSet {
+    public:
+        void Add(int ordinal) {
+            const size_t chunk = ordinal >> CHUNK_BITS;
+            if (chunk >= chunks_.size()) {
+                chunks_.resize(chunk + 1);
+            }
+            chunks_[chunk].Add(ordinal & CHUNK_MASK);
+        }
+
+        void Remove(int ordinal) {
+            const size_t chunk = ordinal >> CHUNK_BITS;
+            if (chunk < chunks_.size()) {
+                chunks_[chunk].Remove(ordinal & CHUNK_MASK);
+            }
+        }
+
+        bool Contains(int ordinal) const {
+            const size_t chunk = ordinal >> CHUNK_BITS;
+            return chunk < chunks_.size() && chunks_[chunk].Contains(ordinal & CHUNK_MASK);
+        }
+
+        // The least ordinal of the set not less than ordinal, END_ORDINAL if there is none
+        int FindNext(int ordinal) const {
+            for (size_t chunk = ordinal >> CHUNK_BITS; chunk < chunks_.size(); ++chunk) {
+                const int first_value = chunk == static_cast<size_t>(ordinal >> CHUNK_BITS) ? ordinal & CHUNK_MASK : 0;
+                const int value = chunks_[chunk].FindNext(first_value);
+                if (value >= 0) {
+                    return static_cast<int>(chunk << CHUNK_BITS) | value;
+                }
+            }
+            return END_ORDINAL;
+        }
+
+    private:
+        static constexpr int CHUNK_BITS = 16;
+        static constexpr int CHUNK_MASK = (1 << CHUNK_BITS) - 1;
+        // 4096 16-bit values take as much as the bitmap of a chunk
+        static constexpr size_t MAX_ARRAY_SIZE = 4096;
+
+        struct Chunk {
+            // Sorted while bits is empty
+            vector<uint16_t> values;
+            vector<uint64_t> bits;
+
+            void Add(int value) {
+                if (!bits.empty()) {
+                    bits[value / 64] |= uint64_t{1} << (value % 64);
+                    return;
+                }
+                const auto it = lower_bound(values.begin(), values.end(), value);
+                if (it != values.end() && *it == value) {
+                    return;
+                }
+                values.insert(it, value);
+                if (values.size() > MAX_ARRAY_SIZE) {
+                    bits.assign((CHUNK_MASK + 1) / 64, 0);
+                    for (const int array_value : values) {
+                        bits[array_value / 64] |= uint64_t{1} << (array_value % 64);
+                    }
+                    values = {};
+                }
+            }
+
+            void Remove(int value) {
+                if (!bits.empty()) {
+                    bits[value / 64] &= ~(uint64_t{1} << (value % 64));
+                    return;
+                }
+                const auto it = lower_bound(values.begin(), values.end(), value);
+                if (it != values.end() && *it == value) {
+                    values.erase(it);
+                }
+            }
+
+            bool Contains(int value) const {
+                if (!bits.empty()) {
+                    return bits[value / 64] >> (value % 64) & 1;
+                }
+                return binary_search(values.begin(), values.end(), value);
+            }
+
+            // -1 if there is no value not less than the given one
+            int FindNext(int value) const {
+                if (bits.empty()) {
+                    const auto it = lower_bound(values.begin(), values.end(), value);
+                    return it == values.end() ? -1 : *it;
+                }
+                size_t word = value / 64;
+                uint64_t word_bits = bits[word] & (~uint64_t{0} << (value % 64));
+                while (word_bits == 0) {
+                    if (++word == bits.size()) {
+                        return -1;
+                    }
+                    word_bits = bits[word];
+                }
+                return word * 64 + __builtin_ctzll(word_bits);
+            }
+        };
+
+        vector<Chunk> chunks_;
+    };
+
+    // LRU cache of query results. Entries are dropped when the generation of the index they
+    // were found in is not the current one; queries from many threads may use it at once
+    class QueryCache {
+    public:
+        explicit QueryCache(size_t capacity)
+            : capacity_(capacity) {
+        }
+
+        optional<vector<Document>> Find(const string& key, uint64_t generation) {
+            lock_guard lock(mutex_);
+            DropOutdated(generation);
+            const auto it = positions_.find(key);
+            if (it == positions_.end()) {
+                ++miss_count_;
+                return nullopt;
+            }
+            ++hit_count_;
+            entries_.splice(entries_.begin(), entries_, it->second);
+            return it->second->second;
+        }
+
+        void Insert(string key, vector<Document> documents, uint64_t generation) {
+            lock_guard lock(mutex_);
+            DropOutdated(generation);
+            if (positions_.count(key)) {
+                return;
+            }
+            entries_.emplace_front(move(key), move(documents));
+            positions_.emplace(entries_.front().first, entries_.begin());
+            if (entries_.size() > capacity_) {
+                positions_.erase(entries_.back().first);
+                entries_.pop_back();
+            }
+        }
+
+        size_t GetHitCount() const {
+            lock_guard lock(mutex_);
+            return hit_count_;
+        }
+
+        size_t GetMissCount() const {
+            lock_guard lock(mutex_);
+            return miss_count_;
+        }
+
+    private:
+        using Entry = pair<string, vector<Document>>;
+
+        size_t capacity_;
+        uint64_t generation_ = 0;
+        // The most recently used entries first
+        list<Entry> entries_;
+        // Keys are views into the keys of entries_
+        unordered_map<string_view, list<Entry>::iterator> positions_;
+        size_t hit_count_ = 0;
+        size_t miss_count_ = 0;
+        mutable mutex mutex_;
+
+        void DropOutdated(uint64_t generation) {
+            if (generation != generation_) {
+                positions_.clear();
+                entries_.clear();
+                generation_ = generation;
+            }
+        }
+    };
+
+    // Fixed threads running the queued tasks in the order they come. At most queue_capacity
+    // tasks wait at a time; the waiting ones are still run when the threads are stopped
+    class QueryThreads {
+    public:
+        QueryThreads(size_t thread_count, size_t queue_capacity)
+            : queue_capacity_(queue_capacity) {
+            for (size_t i = 0; i < thread_count; ++i) {
+                threads_.emplace_back([this] { RunTasks(); });
+            }
+        }
+
+        QueryThreads(const QueryThreads&) = delete;
+        QueryThreads& operator=(const QueryThreads&) = delete;
+
+        ~QueryThreads() {
+            {
+                lock_guard lock(mutex_);
+                is_stopping_ = true;
+            }
+            task_added_.notify_all();
+            for (thread& worker : threads_) {
+                worker.join();
+            }
+        }
+
+        // False, and the task is not taken, when the queue is full
+        bool TrySubmit(function<void()> task) {
+            {
+                lock_guard lock(mutex_);
+                if (tasks_.size() >= queue_capacity_) {
+                    return false;
+                }
+                tasks_.push(move(task));
+            }
+            task_added_.notify_one();
+            return true;
+        }
+
+    private:
+        size_t queue_capacity_;
+        queue<function<void()>> tasks_;
+        bool is_stopping_ = false;
+        mutex mutex_;
+        condition_variable task_added_;
+        vector<thread> threads_;
+
+        void RunTasks() {
+            while (true) {
+                function<void()> task;
+                {
+                    unique_lock lock(mutex_);
+                    task_added_.wait(lock, [this] { return is_stopping_ || !tasks_.empty(); });
+                    if (tasks_.empty()) {
+                        return;
+                    }
+                    task = move(tasks_.front());
+                    tasks_.pop();
+                }
+                task();
+            }
+        }
+    };
+
+    // Scratch memory of the queries running on a thread, released when the outermost of them
+    // finishes. A thread waiting for the shards of its query may run a shard or a query of
+    // someone else meanwhile, and these nested queries take their memory from the same arena
+    class QueryArena {
+    public:
+        QueryArena()
+            : state_(GetState()) {
+            ++state_.depth;
+        }
+
+        QueryArena(const QueryArena&) = delete;
+        QueryArena& operator=(const QueryArena&) = delete;
+
+        ~QueryArena() {
+            if (--state_.depth == 0) {
+                state_.resource.release();
+            }
+        }
+
+        pmr::memory_resource* GetResource() const {
+            return &state_.resource;
+        }
+
+    private:
+        static constexpr size_t INITIAL_BUFFER_SIZE = 64 * 1024;
+
+        struct State {
+            alignas(max_align_t) byte buffer[INITIAL_BUFFER_SIZE];
+            // Keeps the buffers of larger queries for the next ones instead of freeing them
+            pmr::unsynchronized_pool_resource pool{{0, 1 << 24}};
+            pmr::monotonic_buffer_resource resource{buffer, INITIAL_BUFFER_SIZE, &pool};
+            int depth = 0;
+        };
+
+        static State& GetState() {
+            static thread_local State state;
+            return state;
+        }
+
+        State& state_;
+    };
+
+    // Relevances of the documents of an ordinal range, kept in arrays indexed by the ordinal
+    // and reused between queries; only the touched entries are cleared afterwards
+    class RelevanceAccumulator {
+    public:
+        // Also drops what a search left behind when a predicate threw
+        void Reset(int first_ordinal, int last_ordinal) {
+            Clear();
+            first_ordinal_ = first_ordinal;
+            const size_t size = last_ordinal - first_ordinal;
+            if (relevances_.size() < size) {
+                relevances_.resize(size, 0.0);
+                states_.resize(size, UNTOUCHED);
+            }
+        }
+
+        // The predicate is called once per document, when it is first touched
+        template <typename AllowedPredicate>
+        void Add(int ordinal, double relevance, AllowedPredicate is_allowed) {
+            const size_t index = ordinal - first_ordinal_;
+            if (states_[index] == UNTOUCHED) {
+                // Recorded before the predicate runs, so that Clear finds it whatever throws
+                touched_indexes_.push_back(index);
+                states_[index] = is_allowed(ordinal) ? ALLOWED : REJECTED;
+            }
+            if (states_[index] == ALLOWED) {
+                relevances_[index] += relevance;
+            }
+        }
+
+        // Calls func(ordinal, relevance) for the allowed documents in the order of ordinals
+        template <typename Func>
+        void Extract(Func func) {
+            sort(touched_indexes_.begin(), touched_indexes_.end());
+            for (const size_t index : touched_indexes_) {
+                if (states_[index] == ALLOWED) {
+                    func(first_ordinal_ + static_cast<int>(index), relevances_[index]);
+                }
+            }
+            Clear();
+        }
+
+    private:
+        enum State : uint8_t { UNTOUCHED, ALLOWED, REJECTED };
+
+        int first_ordinal_ = 0;
+        vector<double> relevances_;
+        vector<State> states_;
+        vector<size_t> touched_indexes_;
+
+        void Clear() {
+            for (const size_t index : touched_indexes_) {
+                relevances_[index] = 0.0;
+                states_[index] = UNTOUCHED;
+            }
+            touched_indexes_.clear();
+        }
+    };
+
+    // Fenwick tree over ordinals counting the documents that are not removed,
+    // so that the index-th live document is found in O(log N)
+    class LiveOrdinals {
+    public:
+        void PushBack() {
+            const int node = tree_.size() + 1;
+            tree_.push_back(1 + CountBefore(node - 1) - CountBefore(node - (node & -node)));
+        }
+
+        void Remove(int ordinal) {
+            for (int node = ordinal + 1; node <= static_cast<int>(tree_.size()); node += node & -node) {
+                --tree_[node - 1];
+            }
+        }
+
+        // Ordinal of the live document with the given zero-based rank
+        int FindNth(int index) const {
+            int node = 0;
+            for (int step = HighestPowerOfTwo(tree_.size()); step > 0; step /= 2) {
+                if (node + step <= static_cast<int>(tree_.size()) && tree_[node + step - 1] <= index) {
+                    node += step;
+                    index -= tree_[node - 1];
+                }
+            }
+            return node;
+        }
+
+    private:
+        vector<int> tree_;
+
+        // Live documents among the first count ordinals
+        int CountBefore(int count) const {
+            int result = 0;
+            for (int node = count; node > 0; node -= node & -node) {
+                result += tree_[node - 1];
+            }
+            return result;
+        }
+
+        static int HighestPowerOfTwo(size_t value) {
+            int power = 1;
+            while (power * 2 <= static_cast<int>(value)) {
+                power *= 2;
+            }
+            return value == 0 ? 0 : power;
+        }
+    };
+
+    // Stop words get the IDs [0, stop_word_count_), in sorted order
+    TermDictionary terms_;
+    TermId stop_word_count_ = 0;
+    // Indexed by the term ID. Words of removed documents stay here with zero document frequency
+    vector<WordData> word_data_;
+    // Frozen segments in the order of ordinals, followed by active_segment_
+    vector<shared_ptr<const FrozenSegment>> frozen_segments_;
+    ActiveSegment active_segment_;
+    // At most one merge of two adjacent frozen segments runs at a time
+    future<shared_ptr<const FrozenSegment>> merged_segment_;
+    // Document ID -> dense ordinal, used only at the API boundary
+    map<int, int> document_ordinals_;
+    // Document table indexed by ordinal
+    vector<int> ids_;
+    vector<int> ratings_;
+    vector<DocumentStatus> statuses_;
+    // 1 / number of words, to turn term counts of postings into term frequencies
+    vector<double> inv_word_counts_;
+    // Keys are views into terms_; cleared when the document is removed. Built on first use
+    // for the documents of a mapped index
+    mutable vector<map<string_view, double>> word_freqs_;
+    unique_ptr<mutex> word_freqs_mutex_ = make_unique<mutex>();
+    // Changes whenever a document is added or removed
+    uint64_t generation_ = 0;
+    // Null while the query cache is disabled
+    unique_ptr<QueryCache> query_cache_;
+    unique_ptr<SearchProfile> profile_ = make_unique<SearchProfile>();
+    MappedDocuments mapped_documents_;
+    // Postings of removed documents stay in segments until they are merged
+    vector<bool> removed_;
+    LiveOrdinals live_ordinals_;
+    // Live documents of every status, indexed by the status
+    vector<OrdinalSet> status_ordinals_;
+    double log_document_count_ = 0.0;
+    // Null until SetQueryThreads starts them. Declared last, so that the queued queries run
+    // before the rest of the server is destroyed
+    unique_ptr<QueryThreads> query_threads_;
+
+    static bool IsValidWord(string_view word) {
+        // A valid word must not contain special characters
+        return IsValidText(word);
+    }
+
+    bool IsStopTerm(TermId term) const {
+        return term < stop_word_count_;
+    }
+
+    bool IsStopWord(string_view word) const {
+        return IsStopTerm(terms_.Find(word));
+    }
+
+    // Interns the word and makes room for its statistics
+    TermId InternWord(string_view word) {
+        const TermId term = terms_.Intern(word);
+        if (term == word_data_.size()) {
+            word_data_.emplace_back();
+        }
+        return term;
+    }
+
+    // The text is checked for control characters in the same pass that splits it
+    vector<string_view> SplitIntoWordsNoStop(string_view text) const {
+        vector<string_view> words;
+        const bool is_valid = ForEachWord(text, [this, &words](string_view word) {
+            if (!IsStopWord(word)) {
+                words.push_back(word);
+            }
+        });
+        if (!is_valid) {
+            throw invalid_argument("Invalid word try to add"s);
+        }
+        return words;
+    }
+
+    static int ComputeAverageRating(const vector<int>& ratings) {
+        if (ratings.empty()) {
+            return 0;
+        }
+        int rating_sum = 0;
+        for (const int rating : ratings) {
+            rating_sum += rating;
+        }
+        return rating_sum / static_cast<int>(ratings.size());
+    }
+
+    struct QueryWord {
+        string_view data;
+        // NO_TERM for a word that was never indexed
+        TermId term;
+        bool is_minus;
+        bool is_stop;
+    };
+
+    // The word must have no control characters
+    QueryWord ParseQueryWord(string_view text) const {
+        bool is_minus = false;
+        // Word shouldn't be empty
+        if (text[0] == '-') {
+            is_minus = true;
+            text.remove_prefix(1);
+        }
+        if (text.empty() || text[0] == '-') {
+            throw invalid_argument("Invalid word try to request"s);
+        }
+        const TermId term = terms_.Find(text);
+        return {text, term, is_minus, IsStopTerm(term)};
+    }
+
+    // Term IDs of the query words, in the order of the sorted words and without duplicates.
+    // Words that were never indexed are NO_TERM
+    struct Query {
+        explicit Query(pmr::memory_resource* resource)
+            : plus_words(resource)
+            , minus_words(resource) {
+        }
+
+        pmr::vector<TermId> plus_words;
+        pmr::vector<TermId> minus_words;
+        bool has_stop_words = false;
+    };
+
+    // A text with control characters is rejected with invalid_text_error before any of its
+    // words; they are found in the same pass that splits the text
+    Query ParseQuery(string_view text, pmr::memory_resource* resource,
+                     const char* invalid_text_error = "Invalid word try to request") const {
+        pmr::vector<string_view> words(resource);
+        if (!ForEachWord(text, [&words](string_view word) { words.push_back(word); })) {
+            throw invalid_argument(invalid_text_error);
+        }
+        Query query(resource);
+        pmr::vector<QueryWord> plus_words(resource);
+        pmr::vector<QueryWord> minus_words(resource);
+        for (const string_view word : words) {
+            const QueryWord query_word = ParseQueryWord(word);
+            if (!query_word.is_stop) {
+                if (query_word.is_minus) {
+                    minus_words.push_back(query_word);
+                } else {
+                    plus_words.push_back(query_word);
+                }
+            }
+            else query.has_stop_words = true;
+        }
+        SortUniqueWords(plus_words, query.plus_words);
+        SortUniqueWords(minus_words, query.minus_words);
+        return query;
+    }
+
+    // Words are ordered by their text rather than by their IDs, which differ between servers,
+    // so that every server adds up the scores of a query in the same order
+    static void SortUniqueWords(pmr::vector<QueryWord>& words, pmr::vector<TermId>& terms) {
+        const auto word_less = [](const QueryWord& lhs, const QueryWord& rhs) {
+            return lhs.data < rhs.data;
+        };
+        const auto word_equal = [](const QueryWord& lhs, const QueryWord& rhs) {
+            return lhs.data == rhs.data;
+        };
+        sort(words.begin(), words.end(), word_less);
+        words.erase(unique(words.begin(), words.end(), word_equal), words.end());
+        terms.reserve(words.size());
+        for (const QueryWord& word : words) {
+            terms.push_back(word.term);
+        }
+    }
+
+    void AddStatusOrdinal(DocumentStatus status, int ordinal) {
+        const size_t index = static_cast<int>(status);
+        if (index >= status_ordinals_.size()) {
+            status_ordinals_.resize(index + 1);
+        }
+        status_ordinals_[index].Add(ordinal);
+    }
+
+    const OrdinalSet& GetStatusOrdinals(DocumentStatus status) const {
+        static const OrdinalSet empty_ordinals;
+        const size_t index = static_cast<int>(status);
+        return index < status_ordinals_.size() ? status_ordinals_[index] : empty_ordinals;
+    }
+
+    // Null for words that no document contains, NO_TERM included
+    const WordData* FindWordData(TermId term) const {
+        return term >= word_data_.size() || word_data_[term].document_freq == 0 ? nullptr : &word_data_[term];
+    }
+
+    int FindTermCount(TermId term, int ordinal) const {
+        if (ordinal >= active_segment_.first_ordinal) {
+            return active_segment_.FindPostings(term).FindTermCount(ordinal);
+        }
+        const auto it = upper_bound(frozen_segments_.begin(), frozen_segments_.end(), ordinal,
+                                    [](int ordinal, const shared_ptr<const FrozenSegment>& segment) {
+                                        return ordinal < segment->first_ordinal;
+                                    });
+        return (*prev(it))->FindPostings(term).FindTermCount(ordinal);
+    }
+
+    // The interned word if the live document contains it, an empty view otherwise
+    string_view FindIndexedWord(TermId term, int ordinal) const {
+        if (!FindWordData(term) || FindTermCount(term, ordinal) == 0) {
+            return {};
+        }
+        return terms_.GetWord(term);
+    }
+
+    // Calls func(word, term_freq) for the words of the document in sorted order
+    template <typename Func>
+    void ForEachDocumentWord(int ordinal, Func func) const {
+        if (ordinal >= mapped_documents_.document_count) {
+            for (const auto& [word, term_freq] : word_freqs_[ordinal]) {
+                func(word, term_freq);
+            }
+            return;
+        }
+        const FrozenSegment& segment = *mapped_documents_.segment;
+        for (uint64_t i = mapped_documents_.word_offsets[ordinal]; i < mapped_documents_.word_offsets[ordinal + 1]; ++i) {
+            const uint32_t word_index = mapped_documents_.words[i];
+            const int term_count = segment.GetPostings(word_index).FindTermCount(ordinal);
+            func(terms_.GetWord(segment.terms[word_index]), term_count * inv_word_counts_[ordinal]);
+        }
+    }
+
+    // Calls func(ordinal, term_count) for the postings of live documents with
+    // ordinals in [first_ordinal, last_ordinal), in the order of ordinals
+    template <typename Func>
+    void ForEachTermCount(TermId term, int first_ordinal, int last_ordinal, Func func) const {
+        const auto visit_segment = [&](const auto& segment) {
+            if (segment.last_ordinal <= first_ordinal || segment.first_ordinal >= last_ordinal) {
+                return;
+            }
+            segment.FindPostings(term).ForEach(first_ordinal, last_ordinal, [&](int ordinal, int term_count) {
+                if (!removed_[ordinal]) {
+                    func(ordinal, term_count);
+                }
+            });
+        };
+        for (const shared_ptr<const FrozenSegment>& segment : frozen_segments_) {
+            visit_segment(*segment);
+        }
+        visit_segment(active_segment_);
+    }
+
+    // Same as ForEachTermCount, with func(ordinal, term_freq)
+    template <typename Func>
+    void ForEachPosting(TermId term, int first_ordinal, int last_ordinal, Func func) const {
+        ForEachTermCount(term, first_ordinal, last_ordinal, [&](int ordinal, int term_count) {
+            func(ordinal, term_count * inv_word_counts_[ordinal]);
+        });
+    }
+
+    // Words of a document with their counts, sorted; views into the document text
+    struct DocumentWords {
+        vector<pair<string_view, int>> word_counts;
+        double inv_word_count = 0.0;
+    };
+
+    DocumentWords CountDocumentWords(string_view document) const {
+        vector<string_view> words = SplitIntoWordsNoStop(document);
+        DocumentWords result;
+        result.inv_word_count = 1.0 / words.size();
+        sort(words.begin(), words.end());
+        for (const string_view word : words) {
+            if (!result.word_counts.empty() && result.word_counts.back().first == word) {
+                ++result.word_counts.back().second;
+            } else {
+                result.word_counts.emplace_back(word, 1);
+            }
+        }
+        return result;
+    }
+
+    // Documents of AddDocuments with the ordinals [first_index, last_index) of the batch
+    struct BulkPart {
+        int first_index = 0;
+        int last_index = 0;
+        // Sorted by the words, which are views into the documents
+        vector<pair<string_view, PostingList>> word_postings;
+        // Term IDs of word_postings, once they are interned
+        vector<TermId> terms;
+        shared_ptr<const FrozenSegment> segment;
+    };
+
+    // The active segment must be empty, so the documents get the ordinals after all others
+    template <typename ExecutionPolicy>
+    void AddTokenizedDocuments(ExecutionPolicy&& policy, const vector<const DocumentRecord*>& records,
+                               const vector<DocumentWords>& document_words) {
+        const int document_count = records.size();
+        const int first_ordinal = ids_.size();
+        int part_count = 1;
+        if constexpr (!is_same_v<decay_t<ExecutionPolicy>, execution::sequenced_policy>) {
+            part_count = clamp(document_count / ACTIVE_SEGMENT_DOCUMENT_COUNT, 1,
+                               max(static_cast<int>(thread::hardware_concurrency()), 1));
+        }
+        vector<BulkPart> parts(part_count);
+        for (int part = 0; part < part_count; ++part) {
+            parts[part].first_index = static_cast<long long>(document_count) * part / part_count;
+            parts[part].last_index = static_cast<long long>(document_count) * (part + 1) / part_count;
+        }
+
+        // Every part collects the posting lists of its documents
+        for_each(policy, parts.begin(), parts.end(), [&](BulkPart& part) {
+            unordered_map<string_view, PostingList> word_to_postings;
+            for (int index = part.first_index; index < part.last_index; ++index) {
+                for (const auto& [word, term_count] : document_words[index].word_counts) {
+                    word_to_postings[word].Add(first_ordinal + index, term_count);
+                }
+            }
+            part.word_postings.reserve(word_to_postings.size());
+            for (auto& [word, postings] : word_to_postings) {
+                part.word_postings.emplace_back(word, move(postings));
+            }
+            sort(part.word_postings.begin(), part.word_postings.end(), [](const auto& lhs, const auto& rhs) {
+                return lhs.first < rhs.first;
+            });
+        });
+
+        // Words are interned once per part instead of once per posting
+        for (BulkPart& part : parts) {
+            part.terms.reserve(part.word_postings.size());
+            for (const auto& [word, postings] : part.word_postings) {
+                const TermId term = InternWord(word);
+                word_data_[term].UpdateDocumentFreq(postings.ordinals.size());
+                part.terms.push_back(term);
+            }
+        }
+
+        vector<double> inv_word_counts(document_count);
+        vector<map<string_view, double>> word_freqs(document_count);
+        for_each(policy, parts.begin(), parts.end(), [&](BulkPart& part) {
+            for (int index = part.first_index; index < part.last_index; ++index) {
+                const DocumentWords& words = document_words[index];
+                inv_word_counts[index] = words.inv_word_count;
+                for (const auto& [word, term_count] : words.word_counts) {
+                    const auto it = lower_bound(part.word_postings.begin(), part.word_postings.end(), word,
+                                                [](const auto& word_postings, string_view value) {
+                                                    return word_postings.first < value;
+                                                });
+                    const TermId term = part.terms[it - part.word_postings.begin()];
+                    word_freqs[index].emplace_hint(word_freqs[index].end(), terms_.GetWord(term),
+                                                   term_count * words.inv_word_count);
+                }
+            }
+
+            // The segment takes the words in the order of their IDs
+            vector<size_t> order(part.terms.size());
+            iota(order.begin(), order.end(), size_t{0});
+            sort(order.begin(), order.end(), [&part](size_t lhs, size_t rhs) {
+                return part.terms[lhs] < part.terms[rhs];
+            });
+            size_t posting_count = 0;
+            for (const auto& [word, postings] : part.word_postings) {
+                posting_count += postings.ordinals.size();
+            }
+            SegmentBuilder builder(first_ordinal + part.first_index, first_ordinal + part.last_index);
+            builder.Reserve(part.word_postings.size(), part.word_postings.size() + posting_count / POSTING_BLOCK_SIZE,
+                            posting_count * 2);
+            const vector<bool> no_removed(part.last_index - part.first_index, false);
+            for (const size_t i : order) {
+                builder.AppendPostings(part.terms[i], part.word_postings[i].second.GetView(), no_removed,
+                                       inv_word_counts.data() + part.first_index);
+            }
+            part.segment = builder.Build();
+            part.word_postings = {};
+            part.terms = {};
+        });
+
+        ++generation_;
+        for (int index = 0; index < document_count; ++index) {
+            const DocumentRecord& record = *records[index];
+            const int ordinal = first_ordinal + index;
+            document_ordinals_.emplace(record.id, ordinal);
+            ids_.push_back(record.id);
+            ratings_.push_back(ComputeAverageRating(record.ratings));
+            statuses_.push_back(record.status);
+            inv_word_counts_.push_back(inv_word_counts[index]);
+            AddStatusOrdinal(record.status, ordinal);
+            word_freqs_.push_back(move(word_freqs[index]));
+            removed_.push_back(false);
+            live_ordinals_.PushBack();
+        }
+        UpdateLogDocumentCount();
+        for (BulkPart& part : parts) {
+            frozen_segments_.push_back(move(part.segment));
+        }
+        active_segment_ = ActiveSegment{first_ordinal + document_count, first_ordinal + document_count, {}};
+        AdvanceMerges();
+    }
+
+    void FreezeActiveSegment() {
+        vector<pair<TermId, PostingsView>> word_postings;
+        word_postings.reserve(active_segment_.term_postings.size());
+        size_t posting_count = 0;
+        for (const auto& [term, postings] : active_segment_.term_postings) {
+            word_postings.emplace_back(term, postings.GetView());
+            posting_count += postings.ordinals.size();
+        }
+        sort(word_postings.begin(), word_postings.end(),
+             [](const auto& lhs, const auto& rhs) {
+                 return lhs.first < rhs.first;
+             });
+        // Ordinal deltas in the active segment take at most two bytes
+        SegmentBuilder builder(active_segment_.first_ordinal, active_segment_.last_ordinal);
+        builder.Reserve(word_postings.size(), word_postings.size() + posting_count / POSTING_BLOCK_SIZE,
+                        posting_count * 2);
+        const vector<bool> no_removed(active_segment_.last_ordinal - active_segment_.first_ordinal, false);
+        for (const auto& [term, postings] : word_postings) {
+            builder.AppendPostings(term, postings, no_removed, inv_word_counts_.data() + active_segment_.first_ordinal);
+        }
+        frozen_segments_.push_back(builder.Build());
+        active_segment_ = ActiveSegment{active_segment_.last_ordinal, active_segment_.last_ordinal, {}};
+        AdvanceMerges();
+    }
+
+    void AdvanceMerges() {
+        if (!merged_segment_.valid()) {
+            ScheduleMerge();
+        } else if (merged_segment_.wait_for(chrono::seconds(0)) == future_status::ready) {
+            InstallMergedSegment();
+        }
+    }
+
+    // Merges the newest pair of adjacent segments where the older one is not bigger,
+    // so that segment sizes grow geometrically and there are O(log N) of them
+    void ScheduleMerge() {
+        for (size_t i = frozen_segments_.size(); i-- > 1;) {
+            const shared_ptr<const FrozenSegment>& older = frozen_segments_[i - 1];
+            const shared_ptr<const FrozenSegment>& newer = frozen_segments_[i];
+            if (older->GetOrdinalCount() <= newer->GetOrdinalCount()) {
+                vector<bool> removed(removed_.begin() + older->first_ordinal, removed_.begin() + newer->last_ordinal);
+                vector<double> inv_word_counts(inv_word_counts_.begin() + older->first_ordinal,
+                                               inv_word_counts_.begin() + newer->last_ordinal);
+                merged_segment_ = async(launch::async, MergeSegments, older, newer, move(removed),
+                                        move(inv_word_counts));
+                return;
+            }
+        }
+    }
+
+    // Waits for the running merge, replaces its two source segments and starts the next merge
+    void InstallMergedSegment() {
+        shared_ptr<const FrozenSegment> merged = merged_segment_.get();
+        const auto older = find_if(frozen_segments_.begin(), frozen_segments_.end(),
+                                   [&merged](const shared_ptr<const FrozenSegment>& segment) {
+                                       return segment->first_ordinal == merged->first_ordinal;
+                                   });
+        *older = move(merged);
+        frozen_segments_.erase(next(older));
+        ScheduleMerge();
+    }
+
+    // Runs in the background, so it must not touch the server. Postings of the
+    // documents removed before the merge started are dropped
+    static shared_ptr<const FrozenSegment> MergeSegments(shared_ptr<const FrozenSegment> older,
+                                                         shared_ptr<const FrozenSegment> newer,
+                                                         vector<bool> removed, vector<double> inv_word_counts) {
+        SegmentBuilder merged(older->first_ordinal, newer->last_ordinal);
+        merged.Reserve(older->terms.size() + newer->terms.size(), older->GetBlockCount() + newer->GetBlockCount(),
+                       older->GetByteCount() + newer->GetByteCount());
+        size_t older_index = 0;
+        size_t newer_index = 0;
+        while (older_index < older->terms.size() || newer_index < newer->terms.size()) {
+            const bool take_older = newer_index == newer->terms.size()
+                || (older_index < older->terms.size() && older->terms[older_index] <= newer->terms[newer_index]);
+            const FrozenSegment& source = take_older ? *older : *newer;
+            const size_t index = take_older ? older_index++ : newer_index++;
+            merged.AppendPostings(source.terms[index], source.GetPostings(index), removed, inv_word_counts.data());
+        }
+        return merged.Build();
+    }
+
+    struct SearchOptions {
+        // Corpus statistics to compute IDF with instead of the ones of this server
+        const CorpusStatistics* statistics = nullptr;
+        // Scratch memory; the arena of the thread if it is null
+        pmr::memory_resource* resource = nullptr;
+        // Status the results are cached under, if they are cached
+        optional<DocumentStatus> cached_status;
+        // Stops the search early; never stopped if it is null
+        const SearchCancellation* cancellation = nullptr;
+    };
+
+    static bool ShouldStop(const SearchCancellation* cancellation) {
+        return cancellation && cancellation->ShouldStop();
+    }
+
+    template <typename DocumentPredicate>
+    future<SearchResult> SubmitSearch(string_view raw_query, DocumentPredicate document_predicate, size_t top_count,
+                                      SearchOptions options, shared_ptr<const SearchCancellation> cancellation) const {
+        if (!query_threads_) {
+            throw logic_error("Query threads are not started"s);
+        }
+        options.cancellation = cancellation.get();
+        auto result = make_shared<promise<SearchResult>>();
+        future<SearchResult> search_future = result->get_future();
+        const bool is_submitted = query_threads_->TrySubmit(
+            [this, query = string(raw_query), document_predicate, top_count, options, cancellation, result] {
+                try {
+                    SearchResult search_result;
+                    search_result.documents = FindTopDocuments(execution::seq, query, document_predicate,
+                                                               top_count, options);
+                    search_result.is_complete = !cancellation || !cancellation->IsStopped();
+                    result->set_value(move(search_result));
+                } catch (...) {
+                    result->set_exception(current_exception());
+                }
+            });
+        if (!is_submitted) {
+            result->set_exception(make_exception_ptr(runtime_error("Query queue is full"s)));
+        }
+        return search_future;
+    }
+
+    // Predicate of the status overloads. Searches recognize it at compile time: they leap over
+    // the ordinals of the other statuses in the status sets instead of calling it per match
+    struct StatusPredicate {
+        DocumentStatus status;
+
+        bool operator()(int, DocumentStatus document_status, int) const {
+            return document_status == status;
+        }
+    };
+
+    template <typename ExecutionPolicy, typename DocumentPredicate>
+    vector<Document> FindTopDocuments(ExecutionPolicy&& policy, string_view raw_query,
+                                      DocumentPredicate document_predicate, size_t top_count,
+                                      const SearchOptions& options) const {
+        if(raw_query.empty()) {
+            throw invalid_argument("Raw query is empty"s);
+        }
+
+        const QueryArena arena;
+        pmr::memory_resource* const resource = options.resource ? options.resource : arena.GetResource();
+        auto parse_timer = profile_->MeasureStage(SearchStage::PARSE_QUERY);
+        const Query query = ParseQuery(raw_query, resource, "Invalid requests text");
+        parse_timer.Stop();
+
+        if(query.plus_words.empty() && query.minus_words.empty() && query.has_stop_words) {
+            vector<Document> empty_str;
+            return empty_str;
+        }
+
+        string cache_key;
+        if (query_cache_ && options.cached_status) {
+            cache_key = MakeQueryCacheKey(query, *options.cached_status, top_count);
+            if (optional<vector<Document>> cached_result = query_cache_->Find(cache_key, generation_)) {
+                return move(*cached_result);
+            }
+        }
+
+        vector<Document> result = FindAllDocuments(policy, query,
+                                                   ComputeInverseDocumentFreqs(query, options.statistics, resource),
+                                                   document_predicate, top_count, resource, options.cancellation);
+        // Only the best top_count documents get ordered: O(M log K) instead of O(M log M)
+        auto sort_timer = profile_->MeasureStage(SearchStage::SORT_RESULTS);
+        if (result.size() > top_count) {
+            partial_sort(policy, result.begin(), result.begin() + top_count, result.end(), CompareDocuments);
+            result.resize(top_count);
+        } else {
+            sort(policy, result.begin(), result.end(), CompareDocuments);
+        }
+        sort_timer.Stop();
+        // The results of a stopped search may miss documents
+        if (!cache_key.empty() && !(options.cancellation && options.cancellation->IsStopped())) {
+            query_cache_->Insert(move(cache_key), result, generation_);
+        }
+        return result;
+    }
+
+    // Parsed queries with the same words, status and top_count have the same results
+    static string MakeQueryCacheKey(const Query& query, DocumentStatus status, size_t top_count) {
+        string key = to_string(static_cast<int>(status)) + ' ' + to_string(top_count);
+        for (const TermId term : query.plus_words) {
+            key += ' ';
+            key += to_string(term);
+        }
+        // Term IDs never start with a minus, so minus words cannot be mistaken for them
+        for (const TermId term : query.minus_words) {
+            key += " -"s;
+            key += to_string(term);
+        }
+        return key;
+    }
+
+    // IDF of every plus word of the query; words that no document here contains get zero
+    pmr::vector<double> ComputeInverseDocumentFreqs(const Query& query, const CorpusStatistics* statistics,
+                                                    pmr::memory_resource* resource) const {
+        pmr::vector<double> inverse_document_freqs(resource);
+        inverse_document_freqs.reserve(query.plus_words.size());
+        for (const TermId term : query.plus_words) {
+            const WordData* word_data = FindWordData(term);
+            if (!word_data) {
+                inverse_document_freqs.push_back(0.0);
+            } else if (!statistics) {
+                inverse_document_freqs.push_back(ComputeWordInverseDocumentFreq(*word_data));
+            } else {
+                // Every document here is a document of the corpus, so the corpus has the word too
+                const auto it = statistics->document_freqs.find(terms_.GetWord(term));
+                if (it == statistics->document_freqs.end()) {
+                    throw invalid_argument("Corpus statistics miss a query word"s);
+                }
+                inverse_document_freqs.push_back(log(statistics->document_count) - log(it->second));
+            }
+        }
+        return inverse_document_freqs;
+    }
+
+    // log(N / df) = log N - log df: both logarithms are cached, since log N changes
+    // with every added document while log df changes only for the words it contains
+    double ComputeWordInverseDocumentFreq(const WordData& word_data) const {
+        return log_document_count_ - word_data.log_document_freq;
+    }
+
+    void UpdateLogDocumentCount() {
+        log_document_count_ = GetDocumentCount() == 0 ? 0.0 : log(GetDocumentCount());
+    }
+
+    template <typename ExecutionPolicy, typename DocumentPredicate>
+    vector<Document> FindAllDocuments(ExecutionPolicy&& policy, const Query& query,
+                                      const pmr::vector<double>& inverse_document_freqs,
+                                      DocumentPredicate document_predicate, size_t top_count,
+                                      pmr::memory_resource* resource, const SearchCancellation* cancellation) const {
+        if constexpr (is_same_v<decay_t<ExecutionPolicy>, execution::sequenced_policy>) {
+            return FindAllDocuments(query, inverse_document_freqs, document_predicate, 0, ids_.size(), top_count,
+                                    resource, cancellation);
+        } else {
+            return FindAllDocumentsParallel(policy, query, inverse_document_freqs, document_predicate, top_count,
+                                            cancellation);
+        }
+    }
+
+    // Every shard owns a range of ordinals and its own accumulator, and adds up the
+    // plus words in the same order as the sequential path, so relevances are identical
+    template <typename ExecutionPolicy, typename DocumentPredicate>
+    vector<Document> FindAllDocumentsParallel(ExecutionPolicy&& policy, const Query& query,
+                                              const pmr::vector<double>& inverse_document_freqs,
+                                              DocumentPredicate document_predicate, size_t top_count,
+                                              const SearchCancellation* cancellation) const {
+        const int ordinal_count = ids_.size();
+        const int shard_count = min(PARALLEL_SHARD_COUNT, max(ordinal_count, 1));
+        vector<vector<Document>> shard_results(shard_count);
+        for_each(policy, shard_results.begin(), shard_results.end(), [&](vector<Document>& shard_result) {
+            const int shard = &shard_result - shard_results.data();
+            const QueryArena arena;
+            shard_result = FindAllDocuments(query, inverse_document_freqs, document_predicate,
+                                            static_cast<long long>(ordinal_count) * shard / shard_count,
+                                            static_cast<long long>(ordinal_count) * (shard + 1) / shard_count,
+                                            top_count, arena.GetResource(), cancellation);
+        });
+
+        size_t result_size = 0;
+        for (const vector<Document>& shard_result : shard_results) {
+            result_size += shard_result.size();
+        }
+        vector<Document> result;
+        result.reserve(result_size);
+        for (const vector<Document>& shard_result : shard_results) {
+            result.insert(result.end(), shard_result.begin(), shard_result.end());
+        }
+        return result;
+    }
+
+    // Every document with an ordinal in [first_ordinal, last_ordinal) that may be among the
+    // top_count best is returned, though some others may be returned too. A stopped search
+    // returns the documents scored before it stopped, with their full relevances
+    template <typename DocumentPredicate>
+    vector<Document> FindAllDocuments(const Query& query, const pmr::vector<double>& inverse_document_freqs,
+                                      DocumentPredicate document_predicate,
+                                      int first_ordinal, int last_ordinal, size_t top_count,
+                                      pmr::memory_resource* resource, const SearchCancellation* cancellation) const {
+        constexpr bool is_status_only = is_same_v<DocumentPredicate, StatusPredicate>;
+        // Documents with minus words are never scored
+        auto minus_words_timer = profile_->MeasureStage(SearchStage::EXCLUDE_MINUS_WORDS);
+        OrdinalSet excluded_ordinals;
+        for (const TermId term : query.minus_words) {
+            if (FindWordData(term)) {
+                ForEachTermCount(term, first_ordinal, last_ordinal, [&excluded_ordinals](int ordinal, int) {
+                    excluded_ordinals.Add(ordinal);
+                });
+            }
+        }
+        minus_words_timer.Stop();
+
+        auto score_timer = profile_->MeasureStage(SearchStage::SCORE_DOCUMENTS);
+        SearchCounts counts;
+        const bool has_minus_words = !query.minus_words.empty();
+        const auto is_allowed = [&](int ordinal) {
+            if (has_minus_words && excluded_ordinals.Contains(ordinal)) {
+                ++counts.filtered_by_minus_words;
+                return false;
+            }
+            bool is_accepted;
+            if constexpr (is_status_only) {
+                is_accepted = statuses_[ordinal] == document_predicate.status;
+            } else {
+                is_accepted = document_predicate(ids_[ordinal], statuses_[ordinal], ratings_[ordinal]);
+            }
+            if (!is_accepted) {
+                ++counts.filtered_by_predicate;
+            }
+            return is_accepted;
+        };
+        const OrdinalSet* allowed_ordinals = nullptr;
+        if constexpr (is_status_only) {
+            allowed_ordinals = &GetStatusOrdinals(document_predicate.status);
+        }
+
+        TopRelevances top_relevances(top_count, resource);
+        vector<Document> result;
+        // The active segment is small and keeps no block maxima, so all its documents are scored
+        if (last_ordinal > active_segment_.first_ordinal && !ShouldStop(cancellation)) {
+            result = ScoreAllDocuments(query, inverse_document_freqs, is_allowed,
+                                       max(first_ordinal, active_segment_.first_ordinal), last_ordinal, counts);
+            for (const Document& document : result) {
+                top_relevances.Push(document.relevance);
+            }
+        }
+        for (const shared_ptr<const FrozenSegment>& segment : frozen_segments_) {
+            if (segment->last_ordinal > first_ordinal && segment->first_ordinal < last_ordinal) {
+                ScoreTopDocuments(*segment, query, inverse_document_freqs, allowed_ordinals, is_allowed,
+                                  max(first_ordinal, segment->first_ordinal), min(last_ordinal, segment->last_ordinal),
+                                  top_relevances, result, resource, counts, cancellation);
+            }
+        }
+        score_timer.Stop();
+        profile_->Add(counts);
+        return result;
+    }
+
+    // The top_count best relevances seen so far
+    class TopRelevances {
+    public:
+        TopRelevances(size_t top_count, pmr::memory_resource* resource)
+            : top_count_(top_count)
+            , heap_(greater<double>(), pmr::vector<double>(resource)) {
+        }
+
+        void Push(double relevance) {
+            if (heap_.size() < top_count_) {
+                heap_.push(relevance);
+            } else if (top_count_ > 0 && relevance > heap_.top()) {
+                heap_.pop();
+                heap_.push(relevance);
+            }
+        }
+
+        // A document with a lower relevance ranks below top_count others whatever its rating.
+        // The second EPSILON covers the rounding of the bounds it is compared with
+        double GetThreshold() const {
+            if (top_count_ == 0) {
+                return numeric_limits<double>::infinity();
+            }
+            return heap_.size() < top_count_ ? -numeric_limits<double>::infinity() : heap_.top() - 2 * EPSILON;
+        }
+
+    private:
+        size_t top_count_;
+        priority_queue<double, pmr::vector<double>, greater<double>> heap_;
+    };
+
+    struct ScoredWord {
+        PostingCursor cursor;
+        double inverse_document_freq = 0.0;
+        // Largest score the word adds to a document of the segment
+        double max_score = 0.0;
+        size_t query_index = 0;
+    };
+
+    // MaxScore over the ordinals [first_ordinal, last_ordinal) of a frozen segment. Plus words
+    // are ordered by their largest scores; documents are only taken from the essential words,
+    // those that can reach the threshold together with all cheaper words. The cheaper words are
+    // looked up while the block maxima of their postings still let the document reach it.
+    // Candidates outside allowed_ordinals are skipped by leaping to the next allowed one
+    template <typename AllowedPredicate>
+    void ScoreTopDocuments(const FrozenSegment& segment, const Query& query,
+                           const pmr::vector<double>& inverse_document_freqs, const OrdinalSet* allowed_ordinals,
+                           AllowedPredicate is_allowed, int first_ordinal, int last_ordinal,
+                           TopRelevances& top_relevances, vector<Document>& result,
+                           pmr::memory_resource* resource, SearchCounts& counts,
+                           const SearchCancellation* cancellation) const {
+        pmr::vector<ScoredWord> words(resource);
+        words.reserve(query.plus_words.size());
+        for (size_t i = 0; i < query.plus_words.size(); ++i) {
+            if (!FindWordData(query.plus_words[i])) {
+                continue;
+            }
+            const CompressedPostings postings = segment.FindPostings(query.plus_words[i]);
+            if (postings.size == 0) {
+                continue;
+            }
+            PostingCursor cursor(postings);
+            cursor.Advance(first_ordinal);
+            if (cursor.GetOrdinal() < last_ordinal) {
+                const double max_score = cursor.GetMaxTermFreq() * inverse_document_freqs[i];
+                words.push_back({cursor, inverse_document_freqs[i], max_score, i});
+            }
+        }
+        sort(words.begin(), words.end(), [](const ScoredWord& lhs, const ScoredWord& rhs) {
+            return lhs.max_score < rhs.max_score;
+        });
+        // Largest score of the words before i
+        pmr::vector<double> max_score_sums(words.size() + 1, 0.0, resource);
+        for (size_t i = 0; i < words.size(); ++i) {
+            max_score_sums[i + 1] = max_score_sums[i] + words[i].max_score;
+        }
+
+        // Scores are added up in the order of the query words, like in ScoreAllDocuments
+        pmr::vector<double> word_scores(query.plus_words.size(), 0.0, resource);
+        size_t first_essential = 0;
+        // The clock of a deadline is read once per STOP_CHECK_INTERVAL candidates
+        for (size_t candidate_count = 0;; ++candidate_count) {
+            if (candidate_count % STOP_CHECK_INTERVAL == 0 && ShouldStop(cancellation)) {
+                return;
+            }
+            const double threshold = top_relevances.GetThreshold();
+            while (first_essential < words.size() && max_score_sums[first_essential + 1] < threshold) {
+                ++first_essential;
+            }
+            int ordinal = END_ORDINAL;
+            for (size_t i = first_essential; i < words.size(); ++i) {
+                ordinal = min(ordinal, words[i].cursor.GetOrdinal());
+            }
+            if (ordinal >= last_ordinal) {
+                return;
+            }
+            if (allowed_ordinals) {
+                const int allowed_ordinal = allowed_ordinals->FindNext(ordinal);
+                if (allowed_ordinal != ordinal) {
+                    for (size_t i = first_essential; i < words.size(); ++i) {
+                        words[i].cursor.Advance(allowed_ordinal);
+                    }
+                    continue;
+                }
+            }
+            if (removed_[ordinal] || !is_allowed(ordinal)) {
+                for (size_t i = first_essential; i < words.size(); ++i) {
+                    if (words[i].cursor.GetOrdinal() == ordinal) {
+                        words[i].cursor.Next();
+                    }
+                }
+                continue;
+            }
+            ++counts.documents_scored;
+
+            fill(word_scores.begin(), word_scores.end(), 0.0);
+            double score = 0.0;
+            const auto add_score = [&](ScoredWord& word) {
+                ++counts.postings_visited;
+                const double term_freq = word.cursor.GetTermCount() * inv_word_counts_[ordinal];
+                word_scores[word.query_index] = term_freq * word.inverse_document_freq;
+                score += word_scores[word.query_index];
+            };
+            for (size_t i = first_essential; i < words.size(); ++i) {
+                if (words[i].cursor.GetOrdinal() == ordinal) {
+                    add_score(words[i]);
+                    words[i].cursor.Next();
+                }
+            }
+            bool is_pruned = false;
+            for (size_t i = first_essential; i-- > 0;) {
+                ScoredWord& word = words[i];
+                const double block_max_score = word.cursor.GetBlockMaxTermFreq(ordinal) * word.inverse_document_freq;
+                if (score + max_score_sums[i] + block_max_score < threshold) {
+                    is_pruned = true;
+                    break;
+                }
+                word.cursor.Advance(ordinal);
+                if (word.cursor.GetOrdinal() == ordinal) {
+                    add_score(word);
+                }
+            }
+            if (is_pruned) {
+                continue;
+            }
+
+            double relevance = 0.0;
+            for (const double word_score : word_scores) {
+                relevance += word_score;
+            }
+            top_relevances.Push(relevance);
+            result.push_back({ids_[ordinal], relevance, ratings_[ordinal]});
+        }
+    }
+
+    // Scores every allowed document with an ordinal in [first_ordinal, last_ordinal)
+    template <typename AllowedPredicate>
+    vector<Document> ScoreAllDocuments(const Query& query, const pmr::vector<double>& inverse_document_freqs,
+                                       AllowedPredicate is_allowed, int first_ordinal, int last_ordinal,
+                                       SearchCounts& counts) const {
+        // Every thread of the parallel search scores its shards with its own accumulator
+        static thread_local RelevanceAccumulator accumulator;
+        accumulator.Reset(first_ordinal, last_ordinal);
+        for (size_t i = 0; i < query.plus_words.size(); ++i) {
+            const TermId term = query.plus_words[i];
+            if (!FindWordData(term)) {
+                continue;
+            }
+            const double inverse_document_freq = inverse_document_freqs[i];
+            ForEachPosting(term, first_ordinal, last_ordinal, [&](int ordinal, double term_freq) {
+                ++counts.postings_visited;
+                accumulator.Add(ordinal, term_freq * inverse_document_freq, is_allowed);
+            });
+        }
+
+        vector<Document> result;
+        accumulator.Extract([this, &result](int ordinal, double relevance) {
+            result.push_back({ids_[ordinal], relevance, ratings_[ordinal]});
+        });
+        counts.documents_scored += result.size();
+        return result;
+    }
+};
+
+// Results of every query, in the order of the queries. A wrong query throws as in
+// FindTopDocuments; if there are several, the first of them
+vector<vector<Document>> ProcessQueries(const SearchServer& search_server, const vector<string>& queries) {
+    vector<vector<Document>> documents_lists(queries.size());
+    vector<exception_ptr> errors(queries.size());
+    transform(execution::par, queries.begin(), queries.end(), documents_lists.begin(),
+              [&](const string& query) {
+                  try {
+                      return search_server.FindTopDocuments(query);
+                  } catch (...) {
+                      // Exceptions must not leave a parallel algorithm
+                      errors[&query - queries.data()] = current_exception();
+                      return vector<Document>{};
+                  }
+              });
+    for (const exception_ptr& error : errors) {
+        if (error) {
+            rethrow_exception(error);
+        }
+    }
+    return documents_lists;
+}
+
+// Results of every query concatenated in the order of the queries
+vector<Document> ProcessQueriesJoined(const SearchServer& search_server, const vector<string>& queries) {
+    const vector<vector<Document>> documents_lists = ProcessQueries(search_server, queries);
+    vector<size_t> offsets(documents_lists.size());
+    transform_exclusive_scan(documents_lists.begin(), documents_lists.end(), offsets.begin(), size_t{0},
+                             plus<>{}, [](const vector<Document>& documents) {
+                                 return documents.size();
+                             });
+
+    vector<Document> joined(offsets.empty() ? 0 : offsets.back() + documents_lists.back().size());
+    for_each(execution::par, documents_lists.begin(), documents_lists.end(),
+             [&](const vector<Document>& documents) {
+                 const size_t offset = offsets[&documents - documents_lists.data()];
+                 copy(documents.begin(), documents.end(), joined.begin() + offset);
+             });
+    return joined;
+}
+
+// A view of [begin, end) of a container that outlives it
+template <typename Iterator>
+class IteratorRange {
+public:
+    IteratorRange(Iterator begin, Iterator end)
+        : begin_(begin)
+        , end_(end) {
+    }
+
+    Iterator begin() const {
+        return begin_;
+    }
+
+    Iterator end() const {
+        return end_;
+    }
+
+    size_t size() const {
+        return distance(begin_, end_);
+    }
+
+private:
+    Iterator begin_;
+    Iterator end_;
+};
+
+// Pages of page_size elements, the last one possibly shorter; the elements are not copied
+template <typename Iterator>
+class Paginator {
+public:
+    Paginator(Iterator begin, Iterator end, size_t page_size) {
+        if (page_size == 0) {
+            throw invalid_argument("Page size is zero"s);
+        }
+        for (size_t left = distance(begin, end); left > 0;) {
+            const size_t current_page_size = min(page_size, left);
+            const Iterator current_page_end = next(begin, current_page_size);
+            pages_.push_back({begin, current_page_end});
+            left -= current_page_size;
+            begin = current_page_end;
+        }
+    }
+
+    auto begin() const {
+        return pages_.begin();
+    }
+
+    auto end() const {
+        return pages_.end();
+    }
+
+    size_t size() const {
+        return pages_.size();
+    }
+
+private:
+    vector<IteratorRange<Iterator>> pages_;
+};
+
+template <typename Container>
+auto Paginate(const Container& container, size_t page_size) {
+    return Paginator(begin(container), end(container), page_size);
+}
+
+// Pages of a temporary would point into a destroyed container
+template <typename Container>
+auto Paginate(const Container&&, size_t) = delete;
+
+// The results of a single search deep enough for several pages, and the pages over them.
+// Pages point into the results, so the object is neither copied nor moved
+class ResultPages {
+public:
+    ResultPages(vector<Document> documents, size_t page_size)
+        : documents_(move(documents))
+        , pages_(documents_.cbegin(), documents_.cend(), page_size) {
+    }
+
+    ResultPages(const ResultPages&) = delete;
+    ResultPages& operator=(const ResultPages&) = delete;
+
+    auto begin() const {
+        return pages_.begin();
+    }
+
+    auto end() const {
+        return pages_.end();
+    }
+
+    size_t size() const {
+        return pages_.size();
+    }
+
+private:
+    vector<Document> documents_;
+    Paginator<vector<Document>::const_iterator> pages_;
+};
+
+// The first page_count pages of the search results for a status or a predicate. The query is
+// run once with top_count = page_size * page_count instead of once per page
+template <typename StatusOrPredicate>
+ResultPages FindResultPages(const SearchServer& search_server, string_view raw_query,
+                            StatusOrPredicate status_or_predicate, size_t page_size, size_t page_count) {
+    if (page_count > 0 && page_size > numeric_limits<size_t>::max() / page_count) {
+        throw invalid_argument("Too many documents for the pages"s);
+    }
+    return ResultPages(search_server.FindTopDocuments(raw_query, status_or_predicate, page_size * page_count),
+                       page_size);
+}
+
+// Counts the requests of the last day that found nothing. Every request is a minute tick, and
+// only whether it found anything is kept, in a ring buffer of one flag per minute
+class RequestQueue {
+public:
+    explicit RequestQueue(const SearchServer& search_server)
+        : search_server_(search_server) {
+    }
+
+    template <typename DocumentPredicate>
+    vector<Document> AddFindRequest(const string& raw_query, DocumentPredicate document_predicate) {
+        return AddResult(search_server_.FindTopDocuments(raw_query, document_predicate));
+    }
+
+    vector<Document> AddFindRequest(const string& raw_query, DocumentStatus status) {
+        return AddResult(search_server_.FindTopDocuments(raw_query, status));
+    }
+
+    vector<Document> AddFindRequest(const string& raw_query) {
+        return AddResult(search_server_.FindTopDocuments(raw_query));
+    }
+
+    int GetNoResultRequests() const {
+        return no_result_count_;
+    }
+
+private:
+    static constexpr int MIN_IN_DAY = 1440;
+
+    const SearchServer& search_server_;
+    // Ticks of the last day, the oldest one at next_tick_ once the buffer is full
+    array<bool, MIN_IN_DAY> is_empty_result_{};
+    int next_tick_ = 0;
+    int tick_count_ = 0;
+    int no_result_count_ = 0;
+
+    vector<Document> AddResult(vector<Document> documents) {
+        if (tick_count_ == MIN_IN_DAY) {
+            no_result_count_ -= is_empty_result_[next_tick_];
+        } else {
+            ++tick_count_;
+        }
+        is_empty_result_[next_tick_] = documents.empty();
+        no_result_count_ += is_empty_result_[next_tick_];
+        next_tick_ = (next_tick_ + 1) % MIN_IN_DAY;
+        return documents;
+    }
+};
+
+// Removes documents with the same set of words as a document with a lower ID.
+// Returns the removed IDs in ascending order
+vector<int> RemoveDuplicates(SearchServer& search_server) {
+    vector<int> document_ids(search_server.GetDocumentCount());
+    for (int i = 0; i < search_server.GetDocumentCount(); ++i) {
+        document_ids[i] = search_server.GetDocumentId(i);
+    }
+    sort(document_ids.begin(), document_ids.end());
+
+    const auto same_words = [&search_server](int lhs_id, int rhs_id) {
+        const map<string_view, double>& lhs = search_server.GetWordFrequencies(lhs_id);
+        const map<string_view, double>& rhs = search_server.GetWordFrequencies(rhs_id);
+        return equal(lhs.begin(), lhs.end(), rhs.begin(), rhs.end(),
+                     [](const auto& lhs_word, const auto& rhs_word) {
+                         return lhs_word.first == rhs_word.first;
+                     });
+    };
+
+    // Documents are compared only when the fingerprints of their word sets collide
+    unordered_map<size_t, vector<int>> fingerprint_to_ids;
+    vector<int> duplicate_ids;
+    for (const int document_id : document_ids) {
+        size_t fingerprint = 0;
+        for (const auto& [word, _] : search_server.GetWordFrequencies(document_id)) {
+            fingerprint = fingerprint * 37 + hash<string_view>{}(word);
+        }
+        vector<int>& same_fingerprint_ids = fingerprint_to_ids[fingerprint];
+        const bool is_duplicate = any_of(same_fingerprint_ids.begin(), same_fingerprint_ids.end(),
+                                         [&](int original_id) { return same_words(original_id, document_id); });
+        if (is_duplicate) {
+            duplicate_ids.push_back(document_id);
+        } else {
+            same_fingerprint_ids.push_back(document_id);
+        }
+    }
+
+    for (const int document_id : duplicate_ids) {
+        search_server.RemoveDocument(document_id);
+    }
+    return duplicate_ids;
+}
+
+// SearchServer for concurrent ingestion and queries, kept as two replicas in the left-right
+// manner: a change is applied to the replica nobody reads, readers are switched to it, and
+// once the readers of the other replica have left, the change is repeated there. Readers never
+// take a lock, but they are not wait-free: a reader that comes during a switch tries again.
+// A writer waits until the old replica has no readers, so every snapshot and every search in
+// progress holds off AddDocument and RemoveDocument; snapshots have to be short-lived
+class ConcurrentSearchServer {
+public:
+    template <typename StopWords>
+    explicit ConcurrentSearchServer(const StopWords& stop_words)
+        : replicas_{SearchServer(stop_words), SearchServer(stop_words)} {
+    }
+
+    // The snapshot does not change while it is held, and writers wait until it is released.
+    // Views it returns stay valid while the ConcurrentSearchServer exists
+    shared_ptr<const SearchServer> GetSnapshot() const {
+        const int index = EnterReplica();
+        return shared_ptr<const SearchServer>(&replicas_[index], [this, index](const SearchServer*) {
+            LeaveReplica(index);
+        });
+    }
+
+    template <typename... Args>
+    vector<Document> FindTopDocuments(Args&&... args) const {
+        const ReadGuard guard(*this);
+        return guard.Get().FindTopDocuments(forward<Args>(args)...);
+    }
+
+    template <typename... Args>
+    tuple<vector<string_view>, DocumentStatus> MatchDocument(Args&&... args) const {
+        const ReadGuard guard(*this);
+        return guard.Get().MatchDocument(forward<Args>(args)...);
+    }
+
+    int GetDocumentCount() const {
+        const ReadGuard guard(*this);
+        return guard.Get().GetDocumentCount();
+    }
+
+    void AddDocument(int document_id, string_view document, DocumentStatus status, const vector<int>& ratings) {
+        ApplyWrite([&](SearchServer& search_server) {
+            search_server.AddDocument(document_id, document, status, ratings);
+        });
+    }
+
+    void RemoveDocument(int document_id) {
+        ApplyWrite([document_id](SearchServer& search_server) {
+            search_server.RemoveDocument(document_id);
+        });
+    }
+
+private:
+    // Keeps the replica it entered from being changed
+    class ReadGuard {
+    public:
+        explicit ReadGuard(const ConcurrentSearchServer& server)
+            : server_(server)
+            , index_(server.EnterReplica()) {
+        }
+
+        ReadGuard(const ReadGuard&) = delete;
+        ReadGuard& operator=(const ReadGuard&) = delete;
+
+        ~ReadGuard() {
+            server_.LeaveReplica(index_);
+        }
+
+        const SearchServer& Get() const {
+            return server_.replicas_[index_];
+        }
+
+    private:
+        const ConcurrentSearchServer& server_;
+        int index_;
+    };
+
+    array<SearchServer, 2> replicas_;
+    // The replica readers enter; the other one is changed only by the writer
+    atomic<int> active_index_ = 0;
+    mutable array<atomic<int>, 2> reader_counts_{};
+    mutex write_mutex_;
+
+    // A reader counts itself in before it checks the index again, and the writer switches the
+    // index before it checks the count, both in the single order of seq_cst operations. So
+    // either the writer sees the reader or the reader sees the switch and tries again
+    int EnterReplica() const {
+        while (true) {
+            const int index = active_index_.load();
+            reader_counts_[index].fetch_add(1);
+            if (active_index_.load() == index) {
+                return index;
+            }
+            LeaveReplica(index);
+        }
+    }
+
+    void LeaveReplica(int index) const {
+        reader_counts_[index].fetch_sub(1, memory_order_release);
+    }
+
+    // If the change throws, it throws on the first replica, before readers are switched to it
+    template <typename Write>
+    void ApplyWrite(const Write& write) {
+        lock_guard lock(write_mutex_);
+        const int standby_index = 1 - active_index_.load(memory_order_relaxed);
+        write(replicas_[standby_index]);
+        active_index_.store(standby_index);
+        WaitForReaders(1 - standby_index);
+        write(replicas_[1 - standby_index]);
+    }
+
+    void WaitForReaders(int index) const {
+        for (int attempt = 0; reader_counts_[index].load() > 0; ++attempt) {
+            if (attempt < 100) {
+                this_thread::yield();
+            } else {
+                this_thread::sleep_for(chrono::microseconds(50));
+            }
+        }
+    }
+};
+
+// Documents partitioned by ID between independent servers. A query gathers the document
+// frequencies of its words from every shard, runs on all shards with the summed
+// statistics and merges their top documents, so results match a single server's.
+// Shards share nothing but CorpusStatistics and Document lists, so they could as well
+// live in other processes
+class ShardedSearchServer {
+public:
+    template <typename StopWords>
+    ShardedSearchServer(const StopWords& stop_words, int shard_count) {
+        if (shard_count <= 0) {
+            throw invalid_argument("Shard count must be positive"s);
+        }
+        shards_.reserve(shard_count);
+        for (int i = 0; i < shard_count; ++i) {
+            shards_.emplace_back(stop_words);
+        }
+    }
+
+    void AddDocument(int document_id, string_view document, DocumentStatus status, const vector<int>& ratings) {
+        GetShard(document_id).AddDocument(document_id, document, status, ratings);
+    }
+
+    void RemoveDocument(int document_id) {
+        GetShard(document_id).RemoveDocument(document_id);
+    }
+
+    template <typename ExecutionPolicy, typename DocumentPredicate>
+    vector<Document> FindTopDocuments(ExecutionPolicy&& policy, string_view raw_query,
+                                      DocumentPredicate document_predicate,
+                                      size_t top_count = MAX_RESULT_DOCUMENT_COUNT) const {
+        return FindTopDocumentsInShards(policy, raw_query, document_predicate, top_count);
+    }
+
+    template <typename ExecutionPolicy>
+    vector<Document> FindTopDocuments(ExecutionPolicy&& policy, string_view raw_query, DocumentStatus status,
+                                      size_t top_count = MAX_RESULT_DOCUMENT_COUNT) const {
+        return FindTopDocumentsInShards(policy, raw_query, status, top_count);
+    }
+
+    template <typename ExecutionPolicy>
+    vector<Document> FindTopDocuments(ExecutionPolicy&& policy, string_view raw_query) const {
+        return FindTopDocuments(policy, raw_query, DocumentStatus::ACTUAL);
+    }
+
+    template <typename DocumentPredicate>
+    vector<Document> FindTopDocuments(string_view raw_query, DocumentPredicate document_predicate,
+                                      size_t top_count = MAX_RESULT_DOCUMENT_COUNT) const {
+        return FindTopDocuments(execution::seq, raw_query, document_predicate, top_count);
+    }
+
+    vector<Document> FindTopDocuments(string_view raw_query, DocumentStatus status,
+                                      size_t top_count = MAX_RESULT_DOCUMENT_COUNT) const {
+        return FindTopDocuments(execution::seq, raw_query, status, top_count);
+    }
+
+    vector<Document> FindTopDocuments(string_view raw_query) const {
+        return FindTopDocuments(execution::seq, raw_query);
+    }
+
+    tuple<vector<string_view>, DocumentStatus> MatchDocument(string_view raw_query, int document_id) const {
+        return GetShard(document_id).MatchDocument(raw_query, document_id);
+    }
+
+    const map<string_view, double>& GetWordFrequencies(int document_id) const {
+        return GetShard(document_id).GetWordFrequencies(document_id);
+    }
+
+    int GetDocumentCount() const {
+        int document_count = 0;
+        for (const SearchServer& shard : shards_) {
+            document_count += shard.GetDocumentCount();
+        }
+        return document_count;
+    }
+
+    int GetShardCount() const {
+        return shards_.size();
+    }
+
+private:
+    vector<SearchServer> shards_;
+
+    // Negative IDs get some shard too, which rejects them
+    SearchServer& GetShard(int document_id) {
+        return shards_[static_cast<unsigned>(document_id) % shards_.size()];
+    }
+
+    const SearchServer& GetShard(int document_id) const {
+        return shards_[static_cast<unsigned>(document_id) % shards_.size()];
+    }
+
+    static void RethrowFirstError(const vector<exception_ptr>& errors) {
+        for (const exception_ptr& error : errors) {
+            if (error) {
+                rethrow_exception(error);
+            }
+        }
+    }
+
+    // Filter is a status or a predicate, passed to the shards as it is
+    template <typename ExecutionPolicy, typename Filter>
+    vector<Document> FindTopDocumentsInShards(ExecutionPolicy&& policy, string_view raw_query, Filter filter,
+                                              size_t top_count) const {
+        // Exceptions must not leave a parallel algorithm, and a wrong query throws on every shard
+        vector<exception_ptr> errors(shards_.size());
+        vector<CorpusStatistics> shard_statistics(shards_.size());
+        transform(policy, shards_.begin(), shards_.end(), shard_statistics.begin(), [&](const SearchServer& shard) {
+            try {
+                return shard.GetQueryStatistics(raw_query);
+            } catch (...) {
+                errors[&shard - shards_.data()] = current_exception();
+                return CorpusStatistics{};
+            }
+        });
+        RethrowFirstError(errors);
+        CorpusStatistics statistics;
+        for (const CorpusStatistics& shard_statistic : shard_statistics) {
+            statistics.Add(shard_statistic);
+        }
+
+        vector<vector<Document>> shard_results(shards_.size());
+        transform(policy, shards_.begin(), shards_.end(), shard_results.begin(), [&](const SearchServer& shard) {
+            try {
+                return shard.FindTopDocuments(execution::seq, raw_query, filter, top_count, statistics);
+            } catch (...) {
+                errors[&shard - shards_.data()] = current_exception();
+                return vector<Document>{};
+            }
+        });
+        RethrowFirstError(errors);
+
         vector<Document> result;
-        for (const auto &[document_id, relevance] : document_to_relevance) {
-            result.push_back(
-                {document_id, relevance, documents_.at(document_id).rating});
+        for (const vector<Document>& shard_result : shard_results) {
+            result.insert(result.end(), shard_result.begin(), shard_result.end());
+        }
+        const size_t result_size = min(result.size(), top_count);
+        partial_sort(result.begin(), result.begin() + result_size, result.end(), CompareDocuments);
+        result.resize(result_size);
+        return result;
+    }
+};
+
+
+// Input of the stream mode, handed out in blocks of whole lines that are not copied. A regular
+// file is mapped and is a single block; a pipe is read block_size bytes at a time into two
+// buffers in turn, so one block may be read while the previous one is processed
+class LineBlockReader {
+public:
+    static constexpr size_t DEFAULT_BLOCK_SIZE = 1 << 20;
+
+    // fd is not closed by the reader
+    explicit LineBlockReader(int fd, size_t block_size = DEFAULT_BLOCK_SIZE)
+        : fd_(fd)
+        , block_size_(block_size) {
+        struct stat file_stat;
+        if (fstat(fd, &file_stat) == 0 && S_ISREG(file_stat.st_mode) && file_stat.st_size > 0) {
+            void* data = mmap(nullptr, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED) {
+                mapped_data_ = static_cast<const char*>(data);
+                mapped_size_ = file_stat.st_size;
+                unread_ = string_view(mapped_data_, mapped_size_);
+            }
+        }
+    }
+
+    LineBlockReader(const LineBlockReader&) = delete;
+    LineBlockReader& operator=(const LineBlockReader&) = delete;
+
+    ~LineBlockReader() {
+        if (mapped_data_) {
+            munmap(const_cast<char*>(mapped_data_), mapped_size_);
+        }
+    }
+
+    // Empty at the end of the input. The block stays valid until the next but one call;
+    // the last line of the input may have no line feed
+    string_view ReadBlock() {
+        if (mapped_data_) {
+            return exchange(unread_, string_view{});
+        }
+        vector<char>& buffer = buffers_[next_buffer_];
+        next_buffer_ ^= 1;
+        buffer.assign(tail_.begin(), tail_.end());
+        size_t size = buffer.size();
+        while (true) {
+            buffer.resize(size + block_size_);
+            const ssize_t count = ::read(fd_, buffer.data() + size, block_size_);
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            if (count < 0) {
+                throw runtime_error("Cannot read input"s);
+            }
+            if (count == 0) {
+                tail_ = {};
+                return string_view(buffer.data(), size);
+            }
+            // Only the new bytes may have the last line feed
+            const size_t line_end = string_view(buffer.data() + size, count).rfind('\n');
+            size += count;
+            if (line_end != string_view::npos) {
+                const size_t block_size = size - count + line_end + 1;
+                tail_ = string_view(buffer.data() + block_size, size - block_size);
+                return string_view(buffer.data(), block_size);
+            }
+        }
+    }
+
+private:
+    int fd_;
+    size_t block_size_;
+    const char* mapped_data_ = nullptr;
+    size_t mapped_size_ = 0;
+    // The part of the mapped file that was not handed out yet
+    string_view unread_;
+    vector<char> buffers_[2];
+    int next_buffer_ = 0;
+    // The incomplete line after the last block, in the other buffer
+    string_view tail_;
+};
+
+// Collects the output and writes it to the file descriptor in large chunks
+class BufferedWriter {
+public:
+    static constexpr size_t CAPACITY = 1 << 20;
+
+    explicit BufferedWriter(int fd)
+        : fd_(fd) {
+        buffer_.reserve(CAPACITY);
+    }
+
+    BufferedWriter(const BufferedWriter&) = delete;
+    BufferedWriter& operator=(const BufferedWriter&) = delete;
+
+    // Whatever was not flushed is written, and errors are ignored
+    ~BufferedWriter() {
+        try {
+            Flush();
+        } catch (...) {
+        }
+    }
+
+    void Write(string_view text) {
+        if (buffer_.size() + text.size() > CAPACITY) {
+            Flush();
+        }
+        buffer_.append(text);
+    }
+
+    void Flush() {
+        for (size_t written = 0; written < buffer_.size();) {
+            const ssize_t count = ::write(fd_, buffer_.data() + written, buffer_.size() - written);
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            if (count < 0) {
+                throw runtime_error("Cannot write output"s);
+            }
+            written += count;
+        }
+        buffer_.clear();
+    }
+
+private:
+    int fd_;
+    string buffer_;
+};
+
+// The stream mode reads commands from input_fd and writes the results of FIND to output_fd.
+// The first line of the input is the stop words, and every other line is a command:
+//   ADD <id> <status> <ratings> <text>   ratings are comma-separated, or "-" for none;
+//                                        status is ACTUAL, IRRELEVANT, BANNED or REMOVED
+//   FIND <query>                         one line per found document of ACTUAL status,
+//                                        then an empty line
+// Consecutive ADD lines are indexed with AddDocuments, and consecutive FIND lines are searched
+// in parallel; a FIND still sees all documents added above it. An error of a line is written
+// to cerr with the line number after the block of the line is done, and the input goes on
+class StreamSession {
+public:
+    static constexpr size_t MAX_BATCH_DOCUMENTS = 1 << 16;
+    static constexpr size_t MAX_BATCH_QUERIES = 1 << 12;
+
+    explicit StreamSession(int output_fd)
+        : output_(output_fd) {
+    }
+
+    // Lines are not copied, so the block has to stay valid until the call returns
+    void ProcessBlock(string_view block) {
+        while (!block.empty()) {
+            const size_t line_end = block.find('\n');
+            string_view line = block.substr(0, line_end);
+            block.remove_prefix(line_end == string_view::npos ? block.size() : line_end + 1);
+            if (!line.empty() && line.back() == '\r') {
+                line.remove_suffix(1);
+            }
+            ++line_number_;
+            if (!server_) {
+                server_.emplace(line);
+                continue;
+            }
+            try {
+                ProcessLine(line);
+            } catch (const invalid_argument& e) {
+                errors_.emplace_back(line_number_, e.what());
+            }
+        }
+        FlushDocuments();
+        FlushQueries();
+        FlushErrors();
+    }
+
+    void Finish() {
+        output_.Flush();
+    }
+
+private:
+    BufferedWriter output_;
+    optional<SearchServer> server_;
+    int line_number_ = 0;
+    vector<DocumentRecord> documents_;
+    vector<int> document_lines_;
+    vector<string_view> queries_;
+    // Errors of AddDocument are found after the later lines are parsed, so they are all sorted
+    vector<pair<int, string>> errors_;
+
+    void ProcessLine(string_view line) {
+        if (line.empty()) {
+            return;
+        }
+        const string_view command = NextField(line);
+        if (command == "ADD"sv) {
+            FlushQueries();
+            documents_.push_back(ParseDocument(line));
+            document_lines_.push_back(line_number_);
+            if (documents_.size() >= MAX_BATCH_DOCUMENTS) {
+                FlushDocuments();
+            }
+        } else if (command == "FIND"sv) {
+            FlushDocuments();
+            queries_.push_back(line);
+            if (queries_.size() >= MAX_BATCH_QUERIES) {
+                FlushQueries();
+            }
+        } else {
+            throw invalid_argument("Unknown command "s + string(command));
+        }
+    }
+
+    void FlushDocuments() {
+        if (documents_.empty()) {
+            return;
+        }
+        try {
+            server_->AddDocuments(documents_);
+        } catch (const invalid_argument&) {
+            // AddDocuments adds nothing when a record is wrong, so the good ones are added
+            // one by one to find the wrong ones
+            for (size_t i = 0; i < documents_.size(); ++i) {
+                const DocumentRecord& document = documents_[i];
+                try {
+                    server_->AddDocument(document.id, document.text, document.status, document.ratings);
+                } catch (const invalid_argument& e) {
+                    errors_.emplace_back(document_lines_[i], e.what());
+                }
+            }
+        }
+        documents_.clear();
+        document_lines_.clear();
+    }
+
+    void FlushQueries() {
+        if (queries_.empty()) {
+            return;
+        }
+        vector<string> results(queries_.size());
+        transform(execution::par, queries_.begin(), queries_.end(), results.begin(), [this](string_view query) {
+            string result;
+            try {
+                for (const Document& document : server_->FindTopDocuments(query)) {
+                    AppendDocument(result, document);
+                }
+            } catch (const invalid_argument& e) {
+                result += "Error: "sv;
+                result += e.what();
+                result += '\n';
+            }
+            result += '\n';
+            return result;
+        });
+        for (const string& result : results) {
+            output_.Write(result);
+        }
+        queries_.clear();
+    }
+
+    void FlushErrors() {
+        stable_sort(errors_.begin(), errors_.end(), [](const auto& lhs, const auto& rhs) {
+            return lhs.first < rhs.first;
+        });
+        for (const auto& [line_number, message] : errors_) {
+            cerr << "Line "s << line_number << ": "s << message << '\n';
+        }
+        errors_.clear();
+    }
+
+    static string_view NextField(string_view& line) {
+        const size_t field_end = line.find(' ');
+        const string_view field = line.substr(0, field_end);
+        line.remove_prefix(field_end == string_view::npos ? line.size() : field_end + 1);
+        return field;
+    }
+
+    static int ParseInt(string_view text) {
+        int value = 0;
+        const auto [end, error] = from_chars(text.data(), text.data() + text.size(), value);
+        if (text.empty() || error != errc{} || end != text.data() + text.size()) {
+            throw invalid_argument("Wrong number "s + string(text));
+        }
+        return value;
+    }
+
+    static DocumentStatus ParseStatus(string_view text) {
+        static const array<pair<string_view, DocumentStatus>, 4> statuses = {{
+            {"ACTUAL"sv, DocumentStatus::ACTUAL},
+            {"IRRELEVANT"sv, DocumentStatus::IRRELEVANT},
+            {"BANNED"sv, DocumentStatus::BANNED},
+            {"REMOVED"sv, DocumentStatus::REMOVED},
+        }};
+        for (const auto& [name, status] : statuses) {
+            if (text == name) {
+                return status;
+            }
+        }
+        throw invalid_argument("Unknown document status "s + string(text));
+    }
+
+    static DocumentRecord ParseDocument(string_view line) {
+        DocumentRecord document;
+        document.id = ParseInt(NextField(line));
+        document.status = ParseStatus(NextField(line));
+        string_view ratings = NextField(line);
+        if (ratings != "-"sv) {
+            while (true) {
+                const size_t rating_end = ratings.find(',');
+                document.ratings.push_back(ParseInt(ratings.substr(0, rating_end)));
+                if (rating_end == string_view::npos) {
+                    break;
+                }
+                ratings.remove_prefix(rating_end + 1);
+            }
+        }
+        document.text = line;
+        return document;
+    }
+
+    static void AppendDocument(string& out, const Document& document) {
+        char number[32];
+        out += "{ document_id = "sv;
+        out.append(number, to_chars(begin(number), end(number), document.id).ptr);
+        out += ", relevance = "sv;
+        out.append(number, to_chars(begin(number), end(number), document.relevance, chars_format::general, 6).ptr);
+        out += ", rating = "sv;
+        out.append(number, to_chars(begin(number), end(number), document.rating).ptr);
+        out += " }\n"sv;
+    }
+};
+
+// Reading of the next block overlaps with indexing and searching of the previous one
+void RunStreamMode(int input_fd, int output_fd, size_t block_size = LineBlockReader::DEFAULT_BLOCK_SIZE) {
+    LineBlockReader reader(input_fd, block_size);
+    StreamSession session(output_fd);
+    string_view block = reader.ReadBlock();
+    while (!block.empty()) {
+        future<string_view> next_block = async(launch::async, [&reader] {
+            return reader.ReadBlock();
+        });
+        session.ProcessBlock(block);
+        block = next_block.get();
+    }
+    session.Finish();
+}
+
+template <typename T, typename U>
+void AssertEqualImpl(const T& t, const U& u, const string& t_str, const string& u_str, const string& file,
+                     const string& func, unsigned line, const string& hint) {
+    if (t != u) {
+        cerr << boolalpha;
+        cerr << file << "("s << line << "): "s << func << ": "s;
+        cerr << "ASSERT_EQUAL("s << t_str << ", "s << u_str << ") failed: "s;
+        cerr << t << " != "s << u << "."s;
+        if (!hint.empty()) {
+            cerr << " Hint: "s << hint;
+        }
+        cerr << endl;
+        abort();
+    }
+}
+
+void AssertImpl(bool value, const string& expr_str, const string& file, const string& func, unsigned line,
+                const string& hint) {
+    if (!value) {
+        cerr << file << "("s << line << "): "s << func << ": "s;
+        cerr << "Assert("s << expr_str << ") failed."s;
+        if (!hint.empty()) {
+            cerr << " Hint: "s << hint;
+        }
+        cerr << endl;
+        abort();
+    }
+}
+
+template <typename TestFunc>
+void RunTestImpl(const TestFunc& func, const string& test_name) {
+    func();
+    cerr << test_name << " OK"s << endl;
+}
+
+#define RUN_TEST(func) RunTestImpl(func, #func)
+#define ASSERT_EQUAL(a, b) AssertEqualImpl((a), (b), #a, #b, __FILE__, __FUNCTION__, __LINE__, ""s)
+#define ASSERT_EQUAL_HINT(a, b, hint) AssertEqualImpl((a), (b), #a, #b, __FILE__, __FUNCTION__, __LINE__, (hint))
+#define ASSERT(a) AssertImpl((a), #a, __FILE__, __FUNCTION__, __LINE__, ""s);
+#define ASSERT_HINT(a, hint) AssertImpl((a), #a, __FILE__, __FUNCTION__, __LINE__, (hint));
+
+const double EPSILON_TEST = 1e-3;
+
+vector<string> GenerateDictionary(mt19937& generator, int word_count, int max_length) {
+    vector<string> words;
+    words.reserve(word_count);
+    for (int i = 0; i < word_count; ++i) {
+        const int length = uniform_int_distribution(1, max_length)(generator);
+        string word(length, ' ');
+        for (char& c : word) {
+            c = static_cast<char>(uniform_int_distribution<int>('a', 'z')(generator));
+        }
+        words.push_back(move(word));
+    }
+    sort(words.begin(), words.end());
+    words.erase(unique(words.begin(), words.end()), words.end());
+    return words;
+}
+
+string GenerateText(mt19937& generator, const vector<string>& dictionary, int word_count) {
+    string text;
+    for (int i = 0; i < word_count; ++i) {
+        if (i > 0) {
+            text.push_back(' ');
+        }
+        text += dictionary[uniform_int_distribution<int>(0, dictionary.size() - 1)(generator)];
+    }
+    return text;
+}
+
+// -------- Начало модульных тестов поисковой системы ----------
+void TestConstructors(){
+    {
+        //SearchServer server("\x10"s);
+    }
+    {
+        //vector<string> words = {"in"s, "\x10"s};
+        //SearchServer server(words);
+    }
+}
+
+void TestExcludeStopWordsFromAddedDocumentContent() {
+    const int doc_id = 42;
+    const string content = "cat in the city"s;
+    const vector<int> ratings = {1, 2, 3};
+    {
+        SearchServer server(""s);
+        server.AddDocument(doc_id, content, DocumentStatus::ACTUAL, ratings);
+        const auto found_docs = server.FindTopDocuments("in"s);
+        ASSERT_EQUAL_HINT(found_docs.size(), 1u, "Wrong find function"s);
+        const Document& doc0 = found_docs[0];
+        ASSERT_EQUAL_HINT(doc0.id, doc_id, "Wrong ID by FindTopDocuments"s);
+    }
+
+    {
+        SearchServer server("in the"s);
+        server.AddDocument(doc_id, content, DocumentStatus::ACTUAL, ratings);
+        
+        const auto found_docs = server.FindTopDocuments("in"s);
+        ASSERT_HINT(found_docs.empty(), "Stop words must be excluded from documents"s);
+        
+        const auto [matched_doc_42g, status42g] = server.MatchDocument("cat"s, 42);
+        ASSERT_HINT(!matched_doc_42g.empty(), "Wrong to match good words"s);
+        
+        const auto [matched_doc_42b, status42b] = server.MatchDocument("-cat"s, 42);
+        ASSERT_HINT(matched_doc_42b.empty(), "Wrong to match minus words"s);
+        
+        const auto [matched_doc_stop, status_stop] = server.MatchDocument("in"s, 42);
+        ASSERT_HINT(matched_doc_stop.empty(), "Wrong to match stop words"s);
+
+    }
+    {
+        //SearchServer server(""s);
+        //server.AddDocument(2, "чук \x02 гек", DocumentStatus::ACTUAL, {3});
+    }
+    {   
+        /* SearchServer server(""s);
+        server.AddDocument(1, "чук и гек", DocumentStatus::ACTUAL, {3});
+        server.AddDocument(1, "пьют чай", DocumentStatus::ACTUAL, {3, 4, 1}); */
+    }
+    {
+        //SearchServer server(""s);
+        //server.AddDocument(-11, "чук и гек", DocumentStatus::ACTUAL, {3});
+    }
+}
+
+void TestMinusWordsExcluded(){
+    SearchServer server(""s);
+    server.AddDocument(12,"sweet home alabama in"s, DocumentStatus::ACTUAL, {1});
+    server.AddDocument(4,"love me tender love me too"s, DocumentStatus::ACTUAL, {12, 1, 5});
+    {
+        const auto found_docs = server.FindTopDocuments("-in love"s);
+        ASSERT_EQUAL_HINT(found_docs.size(), 1u, "Minus words should be deleted"s);
+        ASSERT(found_docs[0].id == 4);
+    }
+    {
+        const auto found_docs = server.FindTopDocuments("in -love"s);
+        ASSERT_EQUAL_HINT(found_docs.size(), 1u, "Minus words should be deleted"s);
+        ASSERT(found_docs[0].id == 12);
+    }
+    {
+        const auto found_docs = server.FindTopDocuments("-in -love"s);
+        ASSERT_EQUAL_HINT(found_docs.size(), 0, "Minus words should be deleted"s);
+    }
+}
+
+void TestMatchFunction() {
+    SearchServer server(""s);
+    const string expected_word = "love"s;
+
+    server.AddDocument(12,"sweet home alabama in"s, DocumentStatus::ACTUAL, {1});
+    server.AddDocument(4,"love me tender love me too"s, DocumentStatus::ACTUAL, {12, 1, 5});
+    server.AddDocument(42,"I sit and wait any angels"s, DocumentStatus::BANNED, {-2, 3});
+    {
+        const auto [docs, status] = server.MatchDocument("love sweet"s, 4);
+        ASSERT_HINT((docs.size() == 1u) && (docs.at(0) == expected_word), "It has wrong plus word"s);
+        ASSERT_EQUAL_HINT(static_cast<int> (status), static_cast<int> (DocumentStatus::ACTUAL), "It has wrong Document status"s);
+    }
+    {
+        const auto [docs, status] = server.MatchDocument("love -love"s, 4);
+        ASSERT_HINT(docs.size()== 0u, "It has wrong minus words"s);
+    }
+    {
+        const auto [docs, status] = server.MatchDocument("sweet -home"s, 12);
+        ASSERT_HINT(docs.size()== 0u, "It has wrong minus words"s);
+    }
+    {
+        const auto [docs, status] = server.MatchDocument("sit -home"s, 42);
+        ASSERT_HINT(docs.size()== 1u, "It has wrong minus words"s);
+        ASSERT_EQUAL_HINT(static_cast<int> (status), static_cast<int> (DocumentStatus::BANNED), "It has wrong Document status"s);
+    }
+    {
+        const auto [docs, status] = server.MatchDocument("sit any"s, 42);
+        ASSERT_HINT(docs.size()== 2u, "It has added wrong plus words"s);
+    }
+    {
+        const auto [docs, status] = server.MatchDocument("-sit -home"s, 42);
+        ASSERT_HINT(docs.size()== 0u, "It has explicated wrong minus words"s);
+    }
+    {
+        /*const auto [matched_doc_wrong, status_wrong] = server.MatchDocument("кот \x02", 2);
+        ASSERT_HINT(!matched_doc_wrong.empty(), "Wrong to match non-usable words"s);
+        
+        const auto [matched_minmin, status_minmin] = server.MatchDocument("--кот", 2);
+        ASSERT_HINT(!matched_minmin.empty(), "Wrong match --"s); 
+        
+        const auto [matched_id, status_id] = server.MatchDocument("кот", 2);
+        ASSERT_HINT(!matched_id.empty(), "Wrong id"s); 
+
+        const auto [matched_min, status_min] = server.MatchDocument("sit -", 42);
+        ASSERT_HINT(!matched_min.empty(), "Wrong match -"s); */
+    }
+}
+
+void TestFindTopDocumentsPredicate() {
+    SearchServer server("и в на"s);
+    server.AddDocument(12, "белый кот и модный ошейник"s, DocumentStatus::ACTUAL, {1});
+    server.AddDocument(4, "пушистый кот пушистый хвост"s, DocumentStatus::ACTUAL, {12, 1, 5});
+    server.AddDocument(42, "ухоженный пёс выразительные глаза"s, DocumentStatus::BANNED, {-2, 5, 3});
+   
+    vector<Document> b = {{4, 0.6507, 6}, {42, 0.2746, 2}, {12, 0.1014, 1}}; 
+    vector<Document> a = server.FindTopDocuments("пушистый ухоженный кот"s, 
+                        [](int document_id, DocumentStatus status, int rating) {return document_id > 0;});
+    {
+        ASSERT_HINT(a.size() == 3u, "Wrong found amount of documents"s);
+        ASSERT_HINT(abs(a[0].relevance - b[0].relevance) <= EPSILON_TEST, "Wrong relevance by EPSILON_TEST"s);
+        ASSERT_HINT(abs(a[1].relevance - b[1].relevance) <= EPSILON_TEST, "Wrong relevance by EPSILON_TEST"s);
+        ASSERT_HINT(abs(a[2].relevance - b[2].relevance) <= EPSILON_TEST, "Wrong relevance by EPSILON_TEST"s);
+        ASSERT_EQUAL_HINT(a[0].rating, b[0].rating, "Wrong rating find"s);
+        ASSERT_EQUAL_HINT(a[1].rating, b[1].rating, "Wrong rating find"s);
+        ASSERT_EQUAL_HINT(a[2].rating, b[2].rating, "Wrong rating find"s);
+    }
+    {
+        b = {{4, 0.6507, 6}};
+        a = server.FindTopDocuments("пушистый ухоженный кот"s, 
+            [](int document_id, DocumentStatus status, int rating) {return rating >= 5;});
+        
+        ASSERT_HINT(a.size() == 1u, "Wrong filtration by rating"s);
+        ASSERT_HINT(abs(a[0].relevance - b[0].relevance) <= EPSILON_TEST, "Wrong relevance by EPSILON_TEST (with rating filter)"s);
+        ASSERT_EQUAL_HINT(a[0].rating, b[0].rating, "Wrong rating find (with rating filter)"s);
+    }
+    {
+        b = {{4, 0.6507, 6}, {12, 0.1014, 1}};
+        a = server.FindTopDocuments("пушистый ухоженный кот"s, 
+            [](int document_id, DocumentStatus status, int rating) {return status == DocumentStatus::ACTUAL;});
+        
+        ASSERT_HINT(a.size() == 2u, "Wrong filtration by status"s);
+        ASSERT_HINT(abs(a[0].relevance - b[0].relevance) <= EPSILON_TEST, "Wrong relevance by EPSILON_TEST (with status filter)"s);
+        ASSERT_HINT(abs(a[1].relevance - b[1].relevance) <= EPSILON_TEST, "Wrong relevance by EPSILON_TEST (with status filter)"s);
+        ASSERT_EQUAL_HINT(a[0].rating, b[0].rating, "Wrong rating find (with status filter)"s);
+        ASSERT_EQUAL_HINT(a[1].rating, b[1].rating, "Wrong rating find (with status filter)"s);
+    }
+}
+
+void TestFindTopDocumentsStatus() {
+    SearchServer server("и в на"s);
+    server.AddDocument(12, "белый кот и модный ошейник"s, DocumentStatus::ACTUAL, {1});
+    server.AddDocument(4, "пушистый кот пушистый хвост"s, DocumentStatus::ACTUAL, {12, 1, 5});
+    server.AddDocument(42, "ухоженный пёс выразительные глаза"s, DocumentStatus::BANNED, {-2, 5, 3});
+
+    {
+        vector<Document> a = server.FindTopDocuments("пушистый ухоженный кот"s, DocumentStatus::ACTUAL);
+        ASSERT_HINT(a.size() == 2u, "Wrong find by status"s);
+    }
+}
+
+void TestFindTopDocuments() {
+    SearchServer server("и в на"s);
+    server.AddDocument(12, "белый кот и модный ошейник"s, DocumentStatus::IRRELEVANT, {1});
+    server.AddDocument(4, "пушистый кот пушистый хвост"s, DocumentStatus::ACTUAL, {12, 1, 5});
+    server.AddDocument(42, "ухоженный пёс выразительные глаза"s, DocumentStatus::BANNED, {-2, 5, 3});
+
+    {
+        vector<Document> a = server.FindTopDocuments("пушистый ухоженный кот"s);
+        ASSERT_HINT(a.size() == 1u, "Wrong find by default"s);
+    }
+    {
+        /* const auto found_wrong_doc = server.FindTopDocuments("кот \x02");
+        ASSERT_HINT(!found_wrong_doc.empty(), "Wrong to find non-usable words"s);
+        
+        const auto found_doc_1 = server.FindTopDocuments("-");
+        ASSERT_HINT(!found_doc_1.empty(), "Wrong to find minus"s);
+
+        const auto found_doc_minus = server.FindTopDocuments("кот -");
+        ASSERT_HINT(!found_doc_minus.empty(), "Wrong to find minus"s);
+        
+        const auto found_minmin = server.FindTopDocuments("--кот");
+        ASSERT_HINT(!found_minmin.empty(), "Wrong to find --"s); */
+    }
+}
+
+void TestSortByRelevance() {
+    SearchServer server("и в на"s);
+    server.AddDocument(12, "белый кот и модный ошейник"s, DocumentStatus::ACTUAL, {1});
+    server.AddDocument(4, "пушистый кот пушистый хвост"s, DocumentStatus::ACTUAL, {12, 1, 5});
+    server.AddDocument(42, "ухоженный пёс выразительные глаза"s, DocumentStatus::ACTUAL, {-2, 5, 3});
+    
+    {
+        vector<Document> a = server.FindTopDocuments("пушистый ухоженный кот"s);
+        ASSERT_HINT(a.size() == 3u, "Wrong found vector of document size"s);
+        ASSERT_HINT((a[0].relevance >= a[1].relevance) && (a[1].relevance >= a[2].relevance), "Wrong sort by relevancet"s);
+    }
+}
+
+void TestComputingRating() {
+    SearchServer server("и в на"s);
+    server.AddDocument(12, "белый кот и модный ошейник"s, DocumentStatus::ACTUAL, {1});
+    server.AddDocument(4, "пушистый кот пушистый хвост"s, DocumentStatus::ACTUAL, {12, 1, 5});
+    server.AddDocument(42, "ухоженный пёс выразительные глаза"s, DocumentStatus::ACTUAL, {-2, 5, 3});
+
+    vector<Document> a = server.FindTopDocuments("пушистый ухоженный кот"s);
+    ASSERT_HINT((a[0].rating == 6) && (a[1].rating == 2) && (a[2].rating == 1), "Wrong rating calculating"s);
+}
+
+void TestComputingRelevance() {
+    SearchServer server("и в на"s);
+    server.AddDocument(12, "белый кот и модный ошейник"s, DocumentStatus::ACTUAL, {1});
+    server.AddDocument(4, "пушистый кот пушистый хвост"s, DocumentStatus::ACTUAL, {12, 1, 5});
+    server.AddDocument(42, "ухоженный пёс выразительные глаза"s, DocumentStatus::ACTUAL, {-2, 5, 3});
+
+    vector<Document> a = server.FindTopDocuments("пушистый ухоженный кот"s);
+    vector<Document> b = {{4, 0.6507, 6}, {42, 0.2746, 2}, {12, 0.1014, 1}}; 
+
+    ASSERT_EQUAL_HINT(a.size(), b.size(), "Wrong find by default (wrong size of documents found)"s);
+    ASSERT_HINT((a[0].relevance - b[0].relevance) <= EPSILON_TEST, "Wrong computing relevance"s);
+    ASSERT_HINT((a[1].relevance - b[1].relevance) <= EPSILON_TEST, "Wrong computing relevance"s);
+    ASSERT_HINT((a[2].relevance - b[2].relevance) <= EPSILON_TEST, "Wrong computing relevance"s);
+    
+}
+
+void TestCountOfDocuments() {
+    SearchServer server(""s);
+    ASSERT_EQUAL_HINT(server.GetDocumentCount(), 0, "Wrong object init(should be o documents)"s);
+    server.AddDocument(12, "белый кот и модный ошейник"s, DocumentStatus::ACTUAL, {1});
+    ASSERT_EQUAL_HINT(server.GetDocumentCount(), 1u, "Wrong counting document"s);
+    server.AddDocument(4, "пушистый кот пушистый хвост"s, DocumentStatus::ACTUAL, {12, 1, 5});
+    ASSERT_EQUAL_HINT(server.GetDocumentCount(), 2u, "Wrong counting document"s);
+    server.AddDocument(42, "ухоженный пёс выразительные глаза"s, DocumentStatus::ACTUAL, {-2, 5, 3});
+    ASSERT_EQUAL_HINT(server.GetDocumentCount(), 3u, "Wrong counting document"s);
+}
+
+void TestGetDocumentId(){
+    SearchServer server("и в на"s);
+    server.AddDocument(12, "белый кот и модный ошейник"s, DocumentStatus::ACTUAL, {1});
+    server.AddDocument(4, "пушистый кот пушистый хвост"s, DocumentStatus::ACTUAL, {12, 1, 5});
+    server.AddDocument(42, "ухоженный пёс выразительные глаза"s, DocumentStatus::ACTUAL, {-2, 5, 3});
+
+    {
+        int doc_id = server.GetDocumentId(1);
+        ASSERT_HINT(doc_id == 4, "Wrong ID"s);
+    }
+    {
+        //int doc_id = server.GetDocumentId(12);
+    }
+}
+
+void TestPostingListsKeepDocumentOrder() {
+    SearchServer server("и в на"s);
+    server.AddDocument(42, "пушистый пёс"s, DocumentStatus::ACTUAL, {1});
+    server.AddDocument(4, "пушистый кот пушистый хвост"s, DocumentStatus::ACTUAL, {2});
+    server.AddDocument(12, "белый кот и модный ошейник"s, DocumentStatus::ACTUAL, {3});
+
+    const vector<Document> a = server.FindTopDocuments("пушистый кот"s);
+    ASSERT_EQUAL_HINT(a.size(), 3u, "Documents added out of ID order must be found"s);
+    ASSERT_EQUAL(a[0].id, 4);
+    ASSERT_HINT(abs(a[0].relevance - 0.5 * log(3.0 / 2) - 0.25 * log(3.0 / 2)) < EPSILON, "Wrong relevance"s);
+    for (const int document_id : {4, 12, 42}) {
+        const auto [words, status] = server.MatchDocument("пушистый кот"s, document_id);
+        ASSERT_HINT(!words.empty(), "Every document must match its words"s);
+    }
+    const auto [words, status] = server.MatchDocument("пушистый -кот"s, 4);
+    ASSERT_HINT(words.empty(), "Minus word must be found in an out of order posting list"s);
+}
+
+void TestPredicateGetsDocumentData() {
+    SearchServer server("и в на"s);
+    server.AddDocument(42, "пушистый пёс"s, DocumentStatus::BANNED, {-1, -3});
+    server.AddDocument(4, "пушистый кот"s, DocumentStatus::ACTUAL, {2, 4});
+
+    const vector<Document> a = server.FindTopDocuments("пушистый"s,
+        [](int document_id, DocumentStatus status, int rating) {
+            return document_id == 42 && status == DocumentStatus::BANNED && rating == -2;
+        });
+    ASSERT_EQUAL_HINT(a.size(), 1u, "Predicate must get the document ID, status and rating"s);
+    ASSERT_EQUAL(a[0].id, 42);
+    ASSERT_EQUAL(a[0].rating, -2);
+
+    const auto [words, status] = server.MatchDocument("пушистый"s, 4);
+    ASSERT_EQUAL(static_cast<int>(status), static_cast<int>(DocumentStatus::ACTUAL));
+}
+
+// Calls of AllowOrThrow left before it throws; negative never throws
+int predicate_calls_before_throw = -1;
+
+bool AllowOrThrow(int, DocumentStatus, int) {
+    if (predicate_calls_before_throw-- == 0) {
+        throw runtime_error("Predicate failed"s);
+    }
+    return true;
+}
+
+void TestThrowingPredicate() {
+    SearchServer first_server;
+    first_server.AddDocument(1, "cat"s, DocumentStatus::ACTUAL, {1});
+    first_server.AddDocument(2, "cat dog"s, DocumentStatus::ACTUAL, {1});
+    first_server.AddDocument(3, "cat cow"s, DocumentStatus::ACTUAL, {1});
+    predicate_calls_before_throw = 1;
+    try {
+        first_server.FindTopDocuments("cat"s, AllowOrThrow);
+        ASSERT_HINT(false, "The exception of the predicate has to reach the caller"s);
+    } catch (const runtime_error&) {
+    }
+
+    // The second server shares the scoring state of the thread with the first one
+    predicate_calls_before_throw = -1;
+    SearchServer second_server;
+    second_server.AddDocument(7, "bird"s, DocumentStatus::ACTUAL, {1});
+    second_server.AddDocument(8, "fish"s, DocumentStatus::ACTUAL, {2});
+    second_server.AddDocument(9, "worm"s, DocumentStatus::ACTUAL, {3});
+    const vector<Document> found = second_server.FindTopDocuments("fish"s, AllowOrThrow);
+    ASSERT_EQUAL_HINT(found.size(), 1u, "Scores of a failed search must not leak into the next one"s);
+    ASSERT_EQUAL(found[0].id, 8);
+    ASSERT(abs(found[0].relevance - log(3.0)) < 1e-6);
+
+    ASSERT_EQUAL(first_server.FindTopDocuments("cat"s, AllowOrThrow).size(), 3u);
+}
+
+void TestParallelMatchesSequential() {
+    mt19937 generator;
+    const vector<string> dictionary = GenerateDictionary(generator, 100, 3);
+    SearchServer server("a b c"s);
+    for (int i = 0; i < 2'000; ++i) {
+        const auto status = static_cast<DocumentStatus>(uniform_int_distribution(0, 3)(generator));
+        server.AddDocument(i * 3, GenerateText(generator, dictionary, 10), status,
+                           {uniform_int_distribution(-2, 2)(generator)});
+    }
+
+    for (int i = 0; i < 50; ++i) {
+        const string query = GenerateText(generator, dictionary, 5) + " -"s + dictionary[i];
+        for (const DocumentStatus status : {DocumentStatus::ACTUAL, DocumentStatus::BANNED}) {
+            const vector<Document> seq = server.FindTopDocuments(execution::seq, query, status);
+            const vector<Document> par = server.FindTopDocuments(execution::par, query, status);
+            ASSERT_EQUAL_HINT(seq.size(), par.size(), "Parallel search must find the same documents"s);
+            for (size_t j = 0; j < seq.size(); ++j) {
+                ASSERT_EQUAL(seq[j].id, par[j].id);
+                ASSERT_EQUAL(seq[j].relevance, par[j].relevance);
+                ASSERT_EQUAL(seq[j].rating, par[j].rating);
+            }
+        }
+        const auto [seq_words, seq_status] = server.MatchDocument(query, i * 3);
+        const auto [par_words, par_status] = server.MatchDocument(execution::par, query, i * 3);
+        ASSERT_HINT(seq_words == par_words, "Parallel match must find the same words"s);
+        ASSERT_EQUAL(static_cast<int>(seq_status), static_cast<int>(par_status));
+    }
+}
+
+void TestTopCount() {
+    SearchServer server("и в на"s);
+    for (int i = 0; i < 20; ++i) {
+        server.AddDocument(i, "кот "s + string(i + 1, 'a'), DocumentStatus::ACTUAL, {i % 4});
+    }
+    server.AddDocument(100, "пёс"s, DocumentStatus::BANNED, {0});
+
+    const vector<Document> all = server.FindTopDocuments("кот"s, DocumentStatus::ACTUAL, 100);
+    ASSERT_EQUAL_HINT(all.size(), 20u, "Wrong count of documents for a large top count"s);
+    ASSERT_HINT(is_sorted(all.begin(), all.end(), CompareDocuments), "Documents must be sorted"s);
+    ASSERT_EQUAL_HINT(server.FindTopDocuments("кот"s).size(), static_cast<size_t>(MAX_RESULT_DOCUMENT_COUNT),
+                      "Default top count must be MAX_RESULT_DOCUMENT_COUNT"s);
+    for (const size_t top_count : {0u, 1u, 7u, 19u}) {
+        const vector<Document> top = server.FindTopDocuments("кот"s, DocumentStatus::ACTUAL, top_count);
+        ASSERT_EQUAL(top.size(), top_count);
+        for (size_t i = 0; i < top_count; ++i) {
+            ASSERT_EQUAL_HINT(top[i].id, all[i].id, "Top documents must be the best ones"s);
+        }
+        const vector<Document> par = server.FindTopDocuments(execution::par, "кот"s, DocumentStatus::ACTUAL, top_count);
+        ASSERT_EQUAL(par.size(), top_count);
+    }
+    ASSERT_EQUAL(server.FindTopDocuments("пёс кот"s,
+        [](int, DocumentStatus, int rating) { return rating == 3; }, 2).size(), 2u);
+}
+
+void TestProcessQueries() {
+    SearchServer server("и в на"s);
+    server.AddDocument(12, "белый кот и модный ошейник"s, DocumentStatus::ACTUAL, {1});
+    server.AddDocument(4, "пушистый кот пушистый хвост"s, DocumentStatus::ACTUAL, {12, 1, 5});
+    server.AddDocument(42, "ухоженный пёс выразительные глаза"s, DocumentStatus::ACTUAL, {-2, 5, 3});
+    const vector<string> queries = {"пушистый кот"s, "попугай"s, "ухоженный -пёс"s, "белый кот"s, "глаза"s};
+
+    const vector<vector<Document>> documents_lists = ProcessQueries(server, queries);
+    ASSERT_EQUAL(documents_lists.size(), queries.size());
+    vector<int> expected_ids;
+    for (size_t i = 0; i < queries.size(); ++i) {
+        const vector<Document> expected = server.FindTopDocuments(queries[i]);
+        ASSERT_EQUAL_HINT(documents_lists[i].size(), expected.size(), "Wrong result of a query in a batch"s);
+        for (size_t j = 0; j < expected.size(); ++j) {
+            ASSERT_EQUAL(documents_lists[i][j].id, expected[j].id);
+            expected_ids.push_back(expected[j].id);
+        }
+    }
+
+    const vector<Document> joined = ProcessQueriesJoined(server, queries);
+    ASSERT_EQUAL_HINT(joined.size(), expected_ids.size(), "Wrong size of joined results"s);
+    for (size_t i = 0; i < joined.size(); ++i) {
+        ASSERT_EQUAL(joined[i].id, expected_ids[i]);
+    }
+    ASSERT_HINT(ProcessQueriesJoined(server, {}).empty(), "Empty batch must give empty results"s);
+    for (const bool is_joined : {false, true}) {
+        try {
+            const vector<string> wrong_queries = {"пёс"s, "--кот"s};
+            if (is_joined) {
+                ProcessQueriesJoined(server, wrong_queries);
+            } else {
+                ProcessQueries(server, wrong_queries);
+            }
+            ASSERT_HINT(false, "Wrong query in a batch must throw"s);
+        } catch (const invalid_argument&) {
+        }
+    }
+}
+
+void TestStringViewParsing() {
+    const string text = "  пушистый   кот хвост "s;
+    const vector<string_view> words = SplitIntoWords(text);
+    ASSERT_EQUAL(words.size(), 3u);
+    ASSERT_EQUAL(words[0], "пушистый"sv);
+    ASSERT_EQUAL(words[2], "хвост"sv);
+    ASSERT_HINT(SplitIntoWords("   "sv).empty(), "Spaces only text has no words"s);
+
+    SearchServer server("и в на"sv);
+    server.AddDocument(4, "пушистый кот и пушистый хвост"sv, DocumentStatus::ACTUAL, {1});
+    vector<string_view> matched_words;
+    {
+        string query = "хвост пушистый пёс"s;
+        matched_words = get<0>(server.MatchDocument(query, 4));
+        query.assign(query.size(), 'x');
+    }
+    ASSERT_EQUAL_HINT(matched_words.size(), 2u, "Wrong matched words"s);
+    ASSERT_EQUAL_HINT(matched_words[0], "пушистый"sv, "Matched words must not depend on the query text"s);
+    ASSERT_EQUAL(matched_words[1], "хвост"sv);
+    ASSERT_EQUAL(server.FindTopDocuments("кот"sv).size(), 1u);
+}
+
+void TestQueryDuplicateWords() {
+    SearchServer server("и в на"s);
+    server.AddDocument(4, "пушистый кот пушистый хвост"s, DocumentStatus::ACTUAL, {1});
+    server.AddDocument(12, "белый кот и модный ошейник"s, DocumentStatus::ACTUAL, {2});
+
+    const vector<Document> once = server.FindTopDocuments("пушистый кот"s);
+    const vector<Document> repeated = server.FindTopDocuments("кот пушистый кот -пёс пушистый -пёс"s);
+    ASSERT_EQUAL_HINT(once.size(), repeated.size(), "Repeated words must not change the result"s);
+    for (size_t i = 0; i < once.size(); ++i) {
+        ASSERT_EQUAL(once[i].id, repeated[i].id);
+        ASSERT_EQUAL_HINT(once[i].relevance, repeated[i].relevance, "Repeated words must be counted once"s);
+    }
+
+    const auto [words, status] = server.MatchDocument("хвост кот хвост кот"s, 4);
+    ASSERT_EQUAL_HINT(words.size(), 2u, "Matched words must not repeat"s);
+    ASSERT_EQUAL(words[0], "кот"sv);
+    ASSERT_EQUAL(words[1], "хвост"sv);
+    ASSERT_HINT(server.FindTopDocuments("и в"s).empty(), "Stop words only query finds nothing"s);
+}
+
+void TestRemoveDocument() {
+    SearchServer server("и в на"s);
+    server.AddDocument(12, "белый кот и модный ошейник"s, DocumentStatus::ACTUAL, {1});
+    server.AddDocument(4, "пушистый кот пушистый хвост"s, DocumentStatus::ACTUAL, {12, 1, 5});
+    server.AddDocument(42, "ухоженный пёс выразительные глаза"s, DocumentStatus::ACTUAL, {-2, 5, 3});
+    server.AddDocument(7, "пушистый пёс"s, DocumentStatus::ACTUAL, {3});
+
+    const map<string_view, double>& word_freqs = server.GetWordFrequencies(4);
+    ASSERT_EQUAL_HINT(word_freqs.size(), 3u, "Wrong count of document words"s);
+    ASSERT_EQUAL(word_freqs.at("пушистый"sv), 0.5);
+    ASSERT_EQUAL(word_freqs.at("кот"sv), 0.25);
+    ASSERT_HINT(server.GetWordFrequencies(100).empty(), "Unknown document has no words"s);
+
+    server.RemoveDocument(4);
+    ASSERT_EQUAL(server.GetDocumentCount(), 3);
+    ASSERT_HINT(server.GetWordFrequencies(4).empty(), "Removed document has no words"s);
+    const vector<Document> found = server.FindTopDocuments("пушистый кот хвост"s);
+    ASSERT_EQUAL_HINT(found.size(), 2u, "Removed document must not be found"s);
+    ASSERT_EQUAL(found[0].id, 7);
+    ASSERT_HINT(abs(found[0].relevance - 0.5 * log(3.0)) < EPSILON, "IDF must use the remaining documents"s);
+    ASSERT_EQUAL(found[1].id, 12);
+    ASSERT_HINT(server.FindTopDocuments("хвост"s).empty(), "Words of the removed document only find nothing"s);
+    ASSERT_EQUAL(server.GetDocumentId(0), 12);
+    ASSERT_EQUAL_HINT(server.GetDocumentId(1), 42, "Document indexes must skip removed documents"s);
+    ASSERT_EQUAL(server.GetDocumentId(2), 7);
+    try {
+        server.MatchDocument("кот"s, 4);
+        ASSERT_HINT(false, "Removed document must not be matched"s);
+    } catch (const invalid_argument&) {
+    }
+
+    server.RemoveDocument(execution::par, 42);
+    server.RemoveDocument(execution::seq, 100);
+    ASSERT_EQUAL(server.GetDocumentCount(), 2);
+    ASSERT_HINT(server.FindTopDocuments("ухоженный пёс"s)[0].id == 7, "Wrong search after parallel removal"s);
+
+    server.AddDocument(4, "хвост"s, DocumentStatus::ACTUAL, {1});
+    ASSERT_EQUAL_HINT(server.FindTopDocuments("хвост"s).size(), 1u, "Removed ID can be added again"s);
+    ASSERT_EQUAL(server.GetDocumentId(2), 4);
+}
+
+void TestRemoveDuplicates() {
+    SearchServer server("and with"s);
+    server.AddDocument(1, "funny pet and nasty rat"s, DocumentStatus::ACTUAL, {7, 2, 7});
+    server.AddDocument(2, "funny pet with curly hair"s, DocumentStatus::ACTUAL, {1, 2});
+    // Same words only in another order and count
+    server.AddDocument(6, "curly hair funny pet pet"s, DocumentStatus::ACTUAL, {1, 2});
+    // Differs from document 2 by stop words only
+    server.AddDocument(3, "funny pet and curly hair"s, DocumentStatus::ACTUAL, {1, 2});
+    server.AddDocument(4, "nasty rat with curly hair"s, DocumentStatus::BANNED, {1, 2});
+    server.AddDocument(5, "funny funny pet and nasty nasty rat"s, DocumentStatus::ACTUAL, {1, 2});
+    // Subset of another document's words is not a duplicate
+    server.AddDocument(8, "funny pet"s, DocumentStatus::ACTUAL, {1, 2});
+
+    const vector<int> removed_ids = RemoveDuplicates(server);
+    ASSERT_HINT((removed_ids == vector<int>{3, 5, 6}), "Wrong duplicates removed"s);
+    ASSERT_EQUAL(server.GetDocumentCount(), 4);
+    ASSERT_HINT(RemoveDuplicates(server).empty(), "No duplicates must be left"s);
+    const vector<Document> found = server.FindTopDocuments("curly"s, DocumentStatus::ACTUAL);
+    ASSERT_EQUAL_HINT(found.size(), 1u, "Lowest ID of the duplicates must be kept"s);
+    ASSERT_EQUAL(found[0].id, 2);
+}
+
+void TestInverseDocumentFreqUpdates() {
+    SearchServer server(""s);
+    server.AddDocument(1, "кот"s, DocumentStatus::ACTUAL, {1});
+    server.AddDocument(2, "пёс"s, DocumentStatus::ACTUAL, {1});
+    ASSERT_HINT(abs(server.FindTopDocuments("кот"s)[0].relevance - log(2.0)) < EPSILON, "Wrong IDF"s);
+
+    server.AddDocument(3, "кот пёс"s, DocumentStatus::ACTUAL, {1});
+    server.AddDocument(4, "попугай"s, DocumentStatus::ACTUAL, {1});
+    const vector<Document> found = server.FindTopDocuments("кот"s);
+    ASSERT_EQUAL(found.size(), 2u);
+    ASSERT_HINT(abs(found[0].relevance - log(2.0)) < EPSILON, "IDF must follow added documents"s);
+    ASSERT_HINT(abs(found[1].relevance - 0.5 * log(2.0)) < EPSILON, "IDF must follow added documents"s);
+
+    server.RemoveDocument(1);
+    ASSERT_HINT(abs(server.FindTopDocuments("кот"s)[0].relevance - 0.5 * log(3.0)) < EPSILON,
+                "IDF must follow removed documents"s);
+    server.RemoveDocument(3);
+    ASSERT_HINT(server.FindTopDocuments("кот"s).empty(), "Word without documents finds nothing"s);
+    ASSERT_HINT(abs(server.FindTopDocuments("пёс"s)[0].relevance - log(2.0)) < EPSILON,
+                "IDF must follow removed documents"s);
+}
+
+void TestConcurrentSearchServer() {
+    ConcurrentSearchServer server("и в на"s);
+    const int document_count = 200;
+    atomic<bool> writer_finished = false;
+    thread writer([&] {
+        for (int i = 0; i < document_count; ++i) {
+            server.AddDocument(i, i % 2 ? "пушистый кот"s : "пушистый пёс"s, DocumentStatus::ACTUAL, {i});
+            if (i % 10 == 9) {
+                server.RemoveDocument(i - 5);
+            }
+        }
+        writer_finished = true;
+    });
+
+    auto read = [&] {
+        while (!writer_finished) {
+            const shared_ptr<const SearchServer> snapshot = server.GetSnapshot();
+            const auto all = [](int, DocumentStatus, int) { return true; };
+            ASSERT_EQUAL_HINT(snapshot->FindTopDocuments("пушистый"s, all, document_count).size(),
+                              static_cast<size_t>(snapshot->GetDocumentCount()), "Snapshot must be consistent"s);
+            this_thread::yield();
+        }
+    };
+    thread reader1(read);
+    thread reader2(read);
+    writer.join();
+    reader1.join();
+    reader2.join();
+
+    ASSERT_EQUAL(server.GetDocumentCount(), document_count - document_count / 10);
+    ASSERT_EQUAL(server.FindTopDocuments("пёс"s, DocumentStatus::ACTUAL, document_count).size(),
+                 static_cast<size_t>(document_count / 2 - document_count / 10));
+    ASSERT_EQUAL(get<0>(server.MatchDocument("кот пёс"s, 1)).size(), 1u);
+    try {
+        server.AddDocument(1, "кот"s, DocumentStatus::ACTUAL, {1});
+        ASSERT_HINT(false, "Duplicate ID must be rejected"s);
+    } catch (const invalid_argument&) {
+    }
+    ASSERT_EQUAL_HINT(server.GetDocumentCount(), document_count - document_count / 10,
+                      "Failed write must not change the server"s);
+
+    // A held snapshot keeps the writer from changing its replica, while new readers see the change
+    shared_ptr<const SearchServer> snapshot = server.GetSnapshot();
+    atomic<bool> write_finished = false;
+    thread blocked_writer([&] {
+        server.AddDocument(document_count, "кот"s, DocumentStatus::ACTUAL, {1});
+        write_finished = true;
+    });
+    while (server.GetDocumentCount() == snapshot->GetDocumentCount()) {
+        this_thread::yield();
+    }
+    this_thread::sleep_for(chrono::milliseconds(10));
+    ASSERT_HINT(!write_finished, "The writer must wait for the snapshot"s);
+    ASSERT_EQUAL(snapshot->GetDocumentCount(), document_count - document_count / 10);
+    snapshot.reset();
+    blocked_writer.join();
+    ASSERT_EQUAL(server.GetDocumentCount(), document_count - document_count / 10 + 1);
+}
+
+void TestSegmentedIndex() {
+    mt19937 generator(7);
+    const vector<string> dictionary = GenerateDictionary(generator, 200, 4);
+    SearchServer server(""s);
+    const int document_count = 13'000;
+    for (int id = 0; id < document_count; ++id) {
+        server.AddDocument(id, GenerateText(generator, dictionary, 8), DocumentStatus::ACTUAL, {1});
+        if (id % 7 == 3) {
+            server.RemoveDocument(id / 2);
+        }
+    }
+    server.WaitForMerges();
+
+    const auto all = [](int, DocumentStatus, int) { return true; };
+    for (int i = 0; i < 10; ++i) {
+        const string& plus_word = dictionary[i];
+        const string& minus_word = dictionary[i + 10];
+        map<int, double> expected;
+        int document_freq = 0;
+        for (int index = 0; index < server.GetDocumentCount(); ++index) {
+            const int id = server.GetDocumentId(index);
+            const map<string_view, double>& freqs = server.GetWordFrequencies(id);
+            if (freqs.count(plus_word) > 0) {
+                ++document_freq;
+                if (freqs.count(minus_word) == 0) {
+                    expected[id] = freqs.at(plus_word);
+                }
+            }
+        }
+        const double inverse_document_freq = log(server.GetDocumentCount() * 1.0 / document_freq);
+
+        const vector<Document> found = server.FindTopDocuments(
+            plus_word + " -"s + minus_word, all, server.GetDocumentCount());
+        ASSERT_EQUAL(found.size(), expected.size());
+        for (const Document& document : found) {
+            ASSERT_HINT(expected.count(document.id) > 0, "Removed or excluded document found"s);
+            ASSERT_HINT(abs(document.relevance - expected.at(document.id) * inverse_document_freq) < EPSILON,
+                        "Segments must score like a single index"s);
+        }
+        ASSERT_EQUAL(server.FindTopDocuments(execution::par, plus_word + " -"s + minus_word, all,
+                                             server.GetDocumentCount()).size(), expected.size());
+    }
+}
+
+void TestSaveAndOpenIndex() {
+    const string path = "search_server_test.index"s;
+    {
+        SearchServer server("и в на"s);
+        server.AddDocument(1, "пушистый кот пушистый хвост"s, DocumentStatus::ACTUAL, {7, 2, 7});
+        server.AddDocument(2, "пушистый пёс и модный ошейник"s, DocumentStatus::ACTUAL, {1, 2});
+        server.AddDocument(3, "большой пёс скворец"s, DocumentStatus::BANNED, {1, 3, 2});
+        server.AddDocument(4, "ухоженный скворец"s, DocumentStatus::ACTUAL, {5});
+        server.RemoveDocument(2);
+        server.SaveIndex(path);
+    }
+
+    SearchServer server = SearchServer::OpenIndex(path);
+    ASSERT_EQUAL(server.GetDocumentCount(), 3);
+    ASSERT_EQUAL(server.GetDocumentId(1), 3);
+    const vector<Document> found = server.FindTopDocuments("пушистый скворец"s);
+    ASSERT_EQUAL(found.size(), 2u);
+    ASSERT_EQUAL(found[0].id, 1);
+    ASSERT_EQUAL(found[0].rating, 5);
+    ASSERT_HINT(abs(found[0].relevance - 0.5 * log(3.0)) < EPSILON, "Mapped index must keep term frequencies"s);
+    ASSERT_EQUAL(server.FindTopDocuments("скворец"s, DocumentStatus::BANNED)[0].id, 3);
+    ASSERT_HINT(server.FindTopDocuments("пёс -скворец"s, [](int, DocumentStatus, int) { return true; }).empty(),
+                "Removed document must not be saved"s);
+    ASSERT_HINT(server.FindTopDocuments("и"s).empty(), "Stop words must be saved"s);
+    const auto [matched_words, status] = server.MatchDocument("пушистый кот -пёс"s, 1);
+    ASSERT_EQUAL(matched_words.size(), 2u);
+    ASSERT(status == DocumentStatus::ACTUAL);
+    ASSERT_EQUAL(server.GetWordFrequencies(1).at("пушистый"s), 0.5);
+
+    server.AddDocument(5, "пушистый скворец"s, DocumentStatus::ACTUAL, {3});
+    server.RemoveDocument(1);
+    ASSERT_EQUAL(server.FindTopDocuments("пушистый"s).size(), 1u);
+    ASSERT_EQUAL(server.FindTopDocuments("скворец"s).size(), 2u);
+    try {
+        server.AddDocument(4, "кот"s, DocumentStatus::ACTUAL, {1});
+        ASSERT_HINT(false, "Mapped document IDs must be taken"s);
+    } catch (const invalid_argument&) {
+    }
+    remove(path.c_str());
+}
+
+void TestIndexFileValidation() {
+    const string path = "search_server_test.index"s;
+    const auto write_file = [&path](const string& content) {
+        ofstream out(path, ios::binary);
+        out << content;
+    };
+    const auto read_file = [&path] {
+        ifstream in(path, ios::binary);
+        return string(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    };
+
+    // Saving over a mapped index leaves the mapped file as it was
+    {
+        SearchServer large_server;
+        for (int id = 0; id < 1'000; ++id) {
+            large_server.AddDocument(id, "кот номер "s + to_string(id), DocumentStatus::ACTUAL, {id});
+        }
+        large_server.SaveIndex(path);
+        const SearchServer mapped_server = SearchServer::OpenIndex(path);
+        SearchServer small_server;
+        small_server.AddDocument(1, "пёс"s, DocumentStatus::ACTUAL, {1});
+        small_server.SaveIndex(path);
+        ASSERT_EQUAL(mapped_server.FindTopDocuments("номер 999"s)[0].id, 999);
+        ASSERT_EQUAL(mapped_server.FindTopDocuments("кот"s).size(), MAX_RESULT_DOCUMENT_COUNT);
+        ASSERT_EQUAL(SearchServer::OpenIndex(path).GetDocumentCount(), 1);
+        ASSERT_HINT(!ifstream(path + ".tmp"s), "The temporary file must be renamed"s);
+    }
+
+    SearchServer server;
+    server.AddDocument(111'111'111, "a b"s, DocumentStatus::ACTUAL, {1});
+    server.AddDocument(222'222'222, "b c"s, DocumentStatus::BANNED, {2});
+    server.SaveIndex(path);
+    const string content = read_file();
+    const auto replace_int = [&content](int from, int to) {
+        string corrupted = content;
+        const size_t position = corrupted.find(string_view(reinterpret_cast<const char*>(&from), sizeof(from)));
+        ASSERT(position != string::npos);
+        memcpy(corrupted.data() + position, &to, sizeof(to));
+        return corrupted;
+    };
+    // The forward index of the four postings is the last array of the file
+    string wrong_word = content;
+    const uint32_t word_index = 1'000;
+    memcpy(wrong_word.data() + wrong_word.size() - 16, &word_index, sizeof(word_index));
+
+    for (const string& corrupted : {replace_int(222'222'222, 111'111'111), replace_int(222'222'222, -5),
+                                    wrong_word, content.substr(0, content.size() / 2)}) {
+        write_file(corrupted);
+        try {
+            SearchServer::OpenIndex(path);
+            ASSERT_HINT(false, "A corrupt index file must be rejected"s);
+        } catch (const invalid_argument&) {
+        }
+    }
+    write_file(content);
+    ASSERT_EQUAL(SearchServer::OpenIndex(path).GetDocumentCount(), 2);
+    remove(path.c_str());
+}
+
+void TestShardedSearchServer() {
+    mt19937 generator(13);
+    const vector<string> dictionary = GenerateDictionary(generator, 50, 3);
+    SearchServer server("и в на"s);
+    ShardedSearchServer sharded_server("и в на"s, 3);
+    for (int id = 0; id < 300; ++id) {
+        const string document = GenerateText(generator, dictionary, 6) + " и"s;
+        const DocumentStatus status = id % 5 == 0 ? DocumentStatus::BANNED : DocumentStatus::ACTUAL;
+        server.AddDocument(id, document, status, {id % 7});
+        sharded_server.AddDocument(id, document, status, {id % 7});
+    }
+    for (int id = 0; id < 300; id += 11) {
+        server.RemoveDocument(id);
+        sharded_server.RemoveDocument(id);
+    }
+    ASSERT_EQUAL(sharded_server.GetDocumentCount(), server.GetDocumentCount());
+
+    for (int i = 0; i < 20; ++i) {
+        const string query = GenerateText(generator, dictionary, 3) + " -"s + dictionary[i];
+        const vector<Document> expected = server.FindTopDocuments(query, DocumentStatus::ACTUAL, 20);
+        for (const vector<Document>& found : {sharded_server.FindTopDocuments(query, DocumentStatus::ACTUAL, 20),
+                                              sharded_server.FindTopDocuments(execution::par, query,
+                                                                              DocumentStatus::ACTUAL, 20)}) {
+            ASSERT_EQUAL(found.size(), expected.size());
+            for (size_t j = 0; j < found.size(); ++j) {
+                ASSERT_EQUAL(found[j].id, expected[j].id);
+                ASSERT_EQUAL_HINT(found[j].relevance, expected[j].relevance, "IDF must be corpus-wide"s);
+            }
+        }
+        ASSERT(get<0>(sharded_server.MatchDocument(query, 1)) == get<0>(server.MatchDocument(query, 1)));
+    }
+    try {
+        sharded_server.AddDocument(1, "кот"s, DocumentStatus::ACTUAL, {1});
+        ASSERT_HINT(false, "Duplicate ID must be rejected by its shard"s);
+    } catch (const invalid_argument&) {
+    }
+
+    // Errors of the shards reach the caller, as a single server's do
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        try {
+            if (attempt == 0) {
+                sharded_server.FindTopDocuments("--кот"s);
+            } else {
+                sharded_server.FindTopDocuments(execution::par, "--кот"s, DocumentStatus::ACTUAL);
+            }
+            ASSERT_HINT(false, "Wrong query must be rejected"s);
+        } catch (const invalid_argument&) {
+        }
+    }
+    try {
+        sharded_server.FindTopDocuments(execution::par, dictionary[0], [](int, DocumentStatus, int) -> bool {
+            throw runtime_error("Predicate failed"s);
+        });
+        ASSERT_HINT(false, "The exception of the predicate has to reach the caller"s);
+    } catch (const runtime_error&) {
+    }
+}
+
+void TestCompressedPostings() {
+    SearchServer server(""s);
+    string repeated_words;
+    for (int i = 0; i < 300; ++i) {
+        repeated_words += " кот"s;
+    }
+    const int document_count = 10'000;
+    for (int id = 0; id < document_count; ++id) {
+        string document = "пёс"s;
+        if (id == 5 || id == document_count - 1) {
+            document += " скворец"s;
+        }
+        if (id == 100) {
+            document += repeated_words;
+        }
+        server.AddDocument(id, document, DocumentStatus::ACTUAL, {1});
+    }
+    server.WaitForMerges();
+
+    ASSERT_EQUAL(server.FindTopDocuments("пёс"s, DocumentStatus::ACTUAL, document_count).size(),
+                 static_cast<size_t>(document_count));
+    const vector<Document> found = server.FindTopDocuments("скворец"s);
+    ASSERT_EQUAL(found.size(), 2u);
+    ASSERT_EQUAL(found[0].id, 5);
+    ASSERT_EQUAL(found[1].id, document_count - 1);
+    ASSERT_EQUAL(get<0>(server.MatchDocument("скворец"s, document_count - 1)).size(), 1u);
+    ASSERT(get<0>(server.MatchDocument("скворец"s, document_count / 2)).empty());
+    ASSERT_HINT(abs(server.FindTopDocuments("кот"s)[0].relevance - 300.0 / 301 * log(document_count)) < EPSILON,
+                "Large term counts must survive compression"s);
+    ASSERT(abs(server.GetWordFrequencies(100).at("кот"s) - 300.0 / 301) < EPSILON);
+}
+
+void TestTopDocumentsPruning() {
+    mt19937 generator(17);
+    const vector<string> common_words = GenerateDictionary(generator, 20, 3);
+    const vector<string> rare_words = GenerateDictionary(generator, 2'000, 6);
+    SearchServer server(""s);
+    const int document_count = 12'000;
+    for (int id = 0; id < document_count; ++id) {
+        const string document = GenerateText(generator, common_words, 5) + " "s + GenerateText(generator, rare_words, 3);
+        server.AddDocument(id, document, id % 3 == 0 ? DocumentStatus::BANNED : DocumentStatus::ACTUAL,
+                           {static_cast<int>(generator() % 10)});
+        if (id % 13 == 0) {
+            server.RemoveDocument(id / 2);
+        }
+    }
+    server.WaitForMerges();
+
+    const auto even = [](int document_id, DocumentStatus, int) { return document_id % 2 == 0; };
+    for (int i = 0; i < 50; ++i) {
+        const string query = GenerateText(generator, common_words, 2) + " "s + GenerateText(generator, rare_words, 2)
+            + " -"s + rare_words[i];
+        const vector<Document> all = server.FindTopDocuments(query, even, document_count);
+        for (const size_t top_count : {1u, 5u, 20u}) {
+            for (const vector<Document>& top : {server.FindTopDocuments(query, even, top_count),
+                                                server.FindTopDocuments(execution::par, query, even, top_count)}) {
+                ASSERT_EQUAL(top.size(), min(top_count, all.size()));
+                for (size_t j = 0; j < top.size(); ++j) {
+                    ASSERT_EQUAL_HINT(top[j].id, all[j].id, "Pruning must not change the top documents"s);
+                    ASSERT_EQUAL(top[j].relevance, all[j].relevance);
+                }
+            }
+        }
+    }
+}
+
+void TestStatusAndMinusWordSets() {
+    mt19937 generator(23);
+    const vector<string> words = GenerateDictionary(generator, 300, 3);
+    SearchServer server(""s);
+    // Enough documents for the status sets to span several chunks, both sparse and dense ones
+    const int document_count = 70'000;
+    const auto get_status = [](int id) {
+        return id % 97 == 0 ? DocumentStatus::REMOVED
+            : id % 11 == 0 ? DocumentStatus::IRRELEVANT
+            : id % 3 == 0 ? DocumentStatus::BANNED : DocumentStatus::ACTUAL;
+    };
+    for (int id = 0; id < document_count; ++id) {
+        server.AddDocument(id, GenerateText(generator, words, 4), get_status(id), {id % 7});
+    }
+    for (int id = 0; id < document_count; id += 5) {
+        server.RemoveDocument(id);
+    }
+    server.WaitForMerges();
+
+    for (int i = 0; i < 30; ++i) {
+        const string query = GenerateText(generator, words, 3) + " -"s + words[i] + " -"s + words[i + 100];
+        for (const DocumentStatus status : {DocumentStatus::ACTUAL, DocumentStatus::IRRELEVANT,
+                                            DocumentStatus::BANNED, DocumentStatus::REMOVED}) {
+            const auto has_status = [status](int, DocumentStatus document_status, int) {
+                return document_status == status;
+            };
+            for (const size_t top_count : {size_t{5}, static_cast<size_t>(document_count)}) {
+                const vector<Document> expected = server.FindTopDocuments(query, has_status, top_count);
+                for (const vector<Document>& found : {server.FindTopDocuments(query, status, top_count),
+                                                      server.FindTopDocuments(execution::par, query, status, top_count)}) {
+                    ASSERT_EQUAL(found.size(), expected.size());
+                    for (size_t j = 0; j < found.size(); ++j) {
+                        ASSERT_EQUAL(found[j].id, expected[j].id);
+                        ASSERT(get_status(found[j].id) == status);
+                        ASSERT_HINT(found[j].id % 5 != 0, "Removed documents must not be found"s);
+                        const auto [matched_words, matched_status] = server.MatchDocument(query, found[j].id);
+                        ASSERT_HINT(!matched_words.empty(), "Documents with minus words must not be found"s);
+                    }
+                }
+            }
+        }
+    }
+}
+
+void TestQueryMemoryResource() {
+    // Counts the allocations and passes them to the default resource
+    class CountingResource : public pmr::memory_resource {
+    public:
+        int allocation_count = 0;
+
+    private:
+        void* do_allocate(size_t bytes, size_t alignment) override {
+            ++allocation_count;
+            return pmr::new_delete_resource()->allocate(bytes, alignment);
+        }
+
+        void do_deallocate(void* pointer, size_t bytes, size_t alignment) override {
+            pmr::new_delete_resource()->deallocate(pointer, bytes, alignment);
+        }
+
+        bool do_is_equal(const pmr::memory_resource& other) const noexcept override {
+            return this == &other;
+        }
+    };
+
+    mt19937 generator(29);
+    const vector<string> words = GenerateDictionary(generator, 100, 3);
+    SearchServer server("and in"s);
+    for (int id = 0; id < 10'000; ++id) {
+        server.AddDocument(id, GenerateText(generator, words, 6), DocumentStatus::ACTUAL, {id % 5});
+    }
+    server.WaitForMerges();
+
+    const auto all = [](int, DocumentStatus, int) { return true; };
+    CountingResource resource;
+    for (int i = 0; i < 20; ++i) {
+        const string query = GenerateText(generator, words, 3) + " in -"s + words[i];
+        const vector<Document> expected = server.FindTopDocuments(query, all, 10);
+        for (const vector<Document>& found : {server.FindTopDocuments(execution::seq, query, all, 10, resource),
+                                              server.FindTopDocuments(execution::par, query, all, 10, resource)}) {
+            ASSERT_EQUAL(found.size(), expected.size());
+            for (size_t j = 0; j < found.size(); ++j) {
+                ASSERT_EQUAL(found[j].id, expected[j].id);
+                ASSERT_EQUAL(found[j].relevance, expected[j].relevance);
+            }
+        }
+        const int document_id = expected.empty() ? 0 : expected.front().id;
+        const auto [matched_words, status] = server.MatchDocument(execution::seq, query, document_id, resource);
+        const auto [expected_words, expected_status] = server.MatchDocument(query, document_id);
+        ASSERT(matched_words == expected_words);
+    }
+    ASSERT_HINT(resource.allocation_count > 0, "Scratch memory must be taken from the given resource"s);
+}
+
+void TestQueryCache() {
+    SearchServer server("and in"s);
+    server.AddDocument(1, "white cat and fancy collar"s, DocumentStatus::ACTUAL, {8, -3});
+    server.AddDocument(2, "fluffy cat fluffy tail"s, DocumentStatus::ACTUAL, {7, 2, 7});
+    server.AddDocument(3, "groomed dog expressive eyes"s, DocumentStatus::BANNED, {5, -12, 2, 1});
+    server.SetQueryCacheCapacity(2);
+
+    const vector<Document> first = server.FindTopDocuments("fluffy cat"s);
+    ASSERT_EQUAL(server.GetQueryCacheMissCount(), 1u);
+    // The same parsed query, whatever the order, duplicates and stop words
+    const vector<Document> second = server.FindTopDocuments(execution::par, "cat in fluffy cat"s);
+    ASSERT_EQUAL(server.GetQueryCacheHitCount(), 1u);
+    ASSERT_EQUAL(second.size(), first.size());
+    for (size_t i = 0; i < first.size(); ++i) {
+        ASSERT_EQUAL(second[i].id, first[i].id);
+        ASSERT_EQUAL(second[i].relevance, first[i].relevance);
+    }
+
+    server.FindTopDocuments("fluffy cat"s, DocumentStatus::BANNED);
+    server.FindTopDocuments("fluffy cat"s, DocumentStatus::ACTUAL, 1);
+    ASSERT_EQUAL(server.GetQueryCacheMissCount(), 3u);
+    server.FindTopDocuments("fluffy cat"s, [](int, DocumentStatus, int) { return true; });
+    ASSERT_EQUAL_HINT(server.GetQueryCacheMissCount(), 3u, "Predicate queries must bypass the cache"s);
+    ASSERT_EQUAL(server.GetQueryCacheHitCount(), 1u);
+    server.FindTopDocuments("fluffy cat"s);
+    ASSERT_EQUAL_HINT(server.GetQueryCacheMissCount(), 4u, "The least recently used query must be evicted"s);
+
+    server.AddDocument(4, "fluffy cat"s, DocumentStatus::ACTUAL, {9});
+    const vector<Document> after_add = server.FindTopDocuments("fluffy cat"s);
+    ASSERT_EQUAL_HINT(server.GetQueryCacheMissCount(), 5u, "Adding a document must invalidate the cache"s);
+    ASSERT_EQUAL(after_add.size(), 3u);
+    ASSERT_EQUAL(after_add[0].id, 4);
+
+    server.RemoveDocument(4);
+    const vector<Document> after_remove = server.FindTopDocuments("fluffy cat"s);
+    ASSERT_EQUAL_HINT(server.GetQueryCacheMissCount(), 6u, "Removing a document must invalidate the cache"s);
+    ASSERT_EQUAL(after_remove.size(), first.size());
+
+    server.SetQueryCacheCapacity(0);
+    server.FindTopDocuments("fluffy cat"s);
+    ASSERT_EQUAL(server.GetQueryCacheHitCount() + server.GetQueryCacheMissCount(), 0u);
+}
+
+void TestLogDuration() {
+    ostringstream output;
+    {
+        LOG_DURATION_STREAM("Stage"s, output);
+    }
+    const string line = output.str();
+    ASSERT_EQUAL(line.substr(0, 7), "Stage: "s);
+    ASSERT_EQUAL(line.substr(line.size() - 4), " ms\n"s);
+}
+
+void TestSearchProfile() {
+    SearchServer server("and in"s);
+    server.AddDocument(1, "white cat and fancy collar"s, DocumentStatus::ACTUAL, {8, -3});
+    server.AddDocument(2, "fluffy cat fluffy tail"s, DocumentStatus::ACTUAL, {7, 2, 7});
+    server.AddDocument(3, "groomed dog expressive eyes"s, DocumentStatus::BANNED, {5, -12, 2, 1});
+    server.AddDocument(4, "fluffy dog"s, DocumentStatus::ACTUAL, {1});
+    server.FindTopDocuments("fluffy cat dog -collar"s);
+
+    const SearchCounts counts = server.GetProfile().GetCounts();
+    ostringstream metrics;
+    server.GetProfile().WriteMetrics(metrics);
+#ifdef SEARCH_SERVER_PROFILE
+    // Postings of cat: 1, 2; fluffy: 2, 4; dog: 3, 4
+    ASSERT_EQUAL(counts.postings_visited, 6u);
+    ASSERT_EQUAL(counts.documents_scored, 2u);
+    ASSERT_EQUAL(counts.filtered_by_minus_words, 1u);
+    ASSERT_EQUAL(counts.filtered_by_predicate, 1u);
+    for (const SearchStage stage : {SearchStage::PARSE_QUERY, SearchStage::EXCLUDE_MINUS_WORDS,
+                                    SearchStage::SCORE_DOCUMENTS, SearchStage::SORT_RESULTS}) {
+        ASSERT_EQUAL(server.GetProfile().GetStageCount(stage), 1u);
+    }
+    ASSERT(metrics.str().find("search_stage_duration_seconds_count{stage=\"parse_query\"} 1\n"s) != string::npos);
+    ASSERT(metrics.str().find("search_postings_visited_total 6\n"s) != string::npos);
+#else
+    ASSERT_EQUAL_HINT(counts.postings_visited, 0u, "Profiling must be compiled out"s);
+    ASSERT(metrics.str().empty());
+#endif
+}
+
+void TestRequestQueue() {
+    SearchServer search_server("and in at"s);
+    RequestQueue request_queue(search_server);
+    search_server.AddDocument(1, "curly cat curly tail"s, DocumentStatus::ACTUAL, {7, 2, 7});
+    search_server.AddDocument(2, "curly dog and fancy collar"s, DocumentStatus::ACTUAL, {1, 2, 3});
+    search_server.AddDocument(3, "big cat fancy collar "s, DocumentStatus::ACTUAL, {1, 2, 8});
+    search_server.AddDocument(4, "big dog sparrow Eugene"s, DocumentStatus::ACTUAL, {1, 3, 2});
+    search_server.AddDocument(5, "big dog sparrow Vasiliy"s, DocumentStatus::ACTUAL, {1, 1, 1});
+
+    for (int i = 0; i < 1439; ++i) {
+        ASSERT(request_queue.AddFindRequest("empty request"s).empty());
+    }
+    ASSERT_EQUAL(request_queue.GetNoResultRequests(), 1439);
+    // Still within the day: the first empty request is not forgotten yet
+    ASSERT_EQUAL(request_queue.AddFindRequest("curly dog"s).size(), 4u);
+    ASSERT_EQUAL(request_queue.GetNoResultRequests(), 1439);
+    // A new day begins, the first empty request leaves the window
+    ASSERT_EQUAL(request_queue.AddFindRequest("big collar"s, DocumentStatus::ACTUAL).size(), 4u);
+    ASSERT_EQUAL(request_queue.GetNoResultRequests(), 1438);
+    ASSERT_EQUAL(request_queue.AddFindRequest("sparrow"s, [](int, DocumentStatus, int rating) {
+        return rating > 1;
+    }).size(), 1u);
+    ASSERT_EQUAL(request_queue.GetNoResultRequests(), 1437);
+    ASSERT(request_queue.AddFindRequest("sparrow"s, DocumentStatus::BANNED).empty());
+    ASSERT_EQUAL_HINT(request_queue.GetNoResultRequests(), 1437, "An empty result replaces an empty one"s);
+}
+
+void TestPaginator() {
+    const vector<int> values = {1, 2, 3, 4, 5};
+    const auto pages = Paginate(values, 2);
+    ASSERT_EQUAL(pages.size(), 3u);
+    vector<size_t> page_sizes;
+    for (const auto& page : pages) {
+        page_sizes.push_back(page.size());
+    }
+    ASSERT(page_sizes == (vector<size_t>{2, 2, 1}));
+    ASSERT_HINT(&*pages.begin()->begin() == &values[0], "Pages must point into the container"s);
+    ASSERT_HINT(&*prev(pages.end())->begin() == &values[4], "Pages must point into the container"s);
+    const vector<int> no_values;
+    ASSERT_EQUAL(Paginate(no_values, 3).size(), 0u);
+
+    SearchServer server(""s);
+    for (int id = 0; id < 20; ++id) {
+        server.AddDocument(id, "cat"s + (id % 2 == 0 ? " dog"s : ""s), DocumentStatus::ACTUAL, {id});
+    }
+    const vector<Document> expected = server.FindTopDocuments("dog cat"s, DocumentStatus::ACTUAL, 9);
+    const ResultPages result_pages = FindResultPages(server, "dog cat"s, DocumentStatus::ACTUAL, 3, 3);
+    ASSERT_EQUAL(result_pages.size(), 3u);
+    size_t index = 0;
+    for (const auto& page : result_pages) {
+        ASSERT_EQUAL(page.size(), 3u);
+        for (const Document& document : page) {
+            ASSERT_EQUAL(document.id, expected[index++].id);
+        }
+    }
+    const ResultPages predicate_pages = FindResultPages(server, "cat"s, [](int id, DocumentStatus, int) {
+        return id < 4;
+    }, 3, 5);
+    ASSERT_EQUAL(predicate_pages.size(), 2u);
+    try {
+        FindResultPages(server, "cat"s, DocumentStatus::ACTUAL, numeric_limits<size_t>::max() / 2, 3);
+        ASSERT_HINT(false, "Overflowing page count must be rejected"s);
+    } catch (const invalid_argument&) {
+    }
+}
+
+void TestAddDocuments() {
+    mt19937 generator(31);
+    const vector<string> words = GenerateDictionary(generator, 500, 4);
+    vector<string> texts;
+    for (int i = 0; i < 30'000; ++i) {
+        texts.push_back(GenerateText(generator, words, uniform_int_distribution(3, 9)(generator)) + " и"s);
+    }
+    const auto get_status = [](int id) {
+        return id % 7 == 0 ? DocumentStatus::BANNED : DocumentStatus::ACTUAL;
+    };
+    const auto make_records = [&](int first_id, int last_id) {
+        vector<DocumentRecord> records;
+        for (int id = first_id; id < last_id; ++id) {
+            records.push_back({id, texts[id], get_status(id), {id % 10, -(id % 3)}});
         }
-        return result;
+        return records;
+    };
+
+    SearchServer expected_server("и"s);
+    for (int id = 0; id < static_cast<int>(texts.size()); ++id) {
+        expected_server.AddDocument(id, texts[id], get_status(id), {id % 10, -(id % 3)});
     }
-};
+    SearchServer server("и"s);
+    server.AddDocument(0, texts[0], get_status(0), {0, 0});
+    server.AddDocuments(make_records(1, 100));
+    server.AddDocuments(execution::seq, make_records(100, 12'000));
+    server.AddDocuments(make_records(12'000, 30'000));
+    server.WaitForMerges();
+    ASSERT_EQUAL(server.GetDocumentCount(), expected_server.GetDocumentCount());
 
-template <typename T, typename U>
-void AssertEqualImpl(const T& t, const U& u, const string& t_str, const string& u_str, const string& file,
-                     const string& func, unsigned line, const string& hint) {
-    if (t != u) {
-        cerr << boolalpha;
-        cerr << file << "("s << line << "): "s << func << ": "s;
-        cerr << "ASSERT_EQUAL("s << t_str << ", "s << u_str << ") failed: "s;
-        cerr << t << " != "s << u << "."s;
-        if (!hint.empty()) {
-            cerr << " Hint: "s << hint;
+    const auto by_id = [](const Document& lhs, const Document& rhs) {
+        return lhs.id < rhs.id;
+    };
+    for (int i = 0; i < 30; ++i) {
+        const string query = GenerateText(generator, words, 3) + " -"s + words[i];
+        vector<Document> found = server.FindTopDocuments(query, DocumentStatus::ACTUAL, texts.size());
+        vector<Document> expected = expected_server.FindTopDocuments(query, DocumentStatus::ACTUAL, texts.size());
+        sort(found.begin(), found.end(), by_id);
+        sort(expected.begin(), expected.end(), by_id);
+        ASSERT_EQUAL(found.size(), expected.size());
+        for (size_t j = 0; j < found.size(); ++j) {
+            ASSERT_EQUAL(found[j].id, expected[j].id);
+            ASSERT(abs(found[j].relevance - expected[j].relevance) < EPSILON_TEST);
+            ASSERT_EQUAL(found[j].rating, expected[j].rating);
         }
-        cerr << endl;
-        abort();
+        const int document_id = 1'000 * i;
+        ASSERT(get<0>(server.MatchDocument(query, document_id)) == get<0>(expected_server.MatchDocument(query, document_id)));
+        ASSERT(server.GetWordFrequencies(document_id) == expected_server.GetWordFrequencies(document_id));
+    }
+
+    // Nothing is added when a document of the batch is rejected
+    const auto expect_rejected = [&](vector<DocumentRecord> records, const string& hint) {
+        try {
+            server.AddDocuments(records);
+            ASSERT_HINT(false, hint);
+        } catch (const invalid_argument&) {
+        }
+        ASSERT_EQUAL_HINT(server.GetDocumentCount(), static_cast<int>(texts.size()), hint);
+    };
+    vector<DocumentRecord> records = make_records(0, 5'000);
+    for (DocumentRecord& record : records) {
+        record.id += 100'000;
     }
+    vector<DocumentRecord> rejected = records;
+    rejected[4'000].id = 5;
+    expect_rejected(rejected, "IDs must not repeat the indexed ones"s);
+    rejected = records;
+    rejected[4'000].id = rejected[10].id;
+    expect_rejected(rejected, "IDs must not repeat in the batch"s);
+    rejected = records;
+    rejected[4'000].id = -1;
+    expect_rejected(rejected, "IDs must not be negative"s);
+    rejected = records;
+    rejected[4'000].text = "cat \x12 dog"sv;
+    expect_rejected(rejected, "Words must be valid"s);
+    server.AddDocuments(records);
+    ASSERT_EQUAL(server.GetDocumentCount(), static_cast<int>(texts.size() + records.size()));
 }
 
-void AssertImpl(bool value, const string& expr_str, const string& file, const string& func, unsigned line,
-                const string& hint) {
-    if (!value) {
-        cerr << file << "("s << line << "): "s << func << ": "s;
-        cerr << "Assert("s << expr_str << ") failed."s;
-        if (!hint.empty()) {
-            cerr << " Hint: "s << hint;
+void TestShardedStatusQueries() {
+    mt19937 generator(37);
+    const vector<string> words = GenerateDictionary(generator, 200, 3);
+    SearchServer server(""s);
+    ShardedSearchServer sharded_server(""s, 3);
+    for (int id = 0; id < 15'000; ++id) {
+        const string text = GenerateText(generator, words, 5);
+        const DocumentStatus status = id % 4 == 0 ? DocumentStatus::BANNED : DocumentStatus::ACTUAL;
+        server.AddDocument(id, text, status, {id % 9});
+        sharded_server.AddDocument(id, text, status, {id % 9});
+    }
+    for (int id = 0; id < 15'000; id += 11) {
+        server.RemoveDocument(id);
+        sharded_server.RemoveDocument(id);
+    }
+    server.WaitForMerges();
+
+    for (int i = 0; i < 20; ++i) {
+        const string query = GenerateText(generator, words, 2) + " -"s + words[i];
+        for (const DocumentStatus status : {DocumentStatus::ACTUAL, DocumentStatus::BANNED}) {
+            const auto has_status = [status](int, DocumentStatus document_status, int) {
+                return document_status == status;
+            };
+            const vector<Document> expected = server.FindTopDocuments(query, has_status);
+            for (const vector<Document>& found : {server.FindTopDocuments(query, status),
+                                                  sharded_server.FindTopDocuments(query, status),
+                                                  sharded_server.FindTopDocuments(query, has_status)}) {
+                ASSERT_EQUAL(found.size(), expected.size());
+                for (size_t j = 0; j < found.size(); ++j) {
+                    ASSERT_EQUAL(found[j].id, expected[j].id);
+                    ASSERT(abs(found[j].relevance - expected[j].relevance) < EPSILON_TEST);
+                }
+            }
         }
-        cerr << endl;
-        abort();
     }
 }
 
-template <typename TestFunc>
-void RunTestImpl(const TestFunc& func, const string& test_name) {
-    func();
-    cerr << test_name << " OK"s << endl;
+void TestTermDictionary() {
+    SearchServer server("in the"s);
+    const string long_word(100'000, 'a');
+    server.AddDocument(1, "cat in the city"s, DocumentStatus::ACTUAL, {1});
+    server.AddDocument(2, "dog and cat"s, DocumentStatus::ACTUAL, {2});
+    server.AddDocument(3, long_word + " cat"s, DocumentStatus::BANNED, {3});
+
+    // Every word is interned once, and all views of it point to the same chars
+    const vector<string_view> first_words = get<0>(server.MatchDocument("cat city"s, 1));
+    const vector<string_view> second_words = get<0>(server.MatchDocument("cat dog"s, 2));
+    ASSERT_EQUAL(first_words.size(), 2u);
+    ASSERT_EQUAL(second_words.size(), 2u);
+    ASSERT_EQUAL(first_words[0], "cat"s);
+    ASSERT_EQUAL(second_words[0], "cat"s);
+    ASSERT(first_words[0].data() == second_words[0].data());
+    ASSERT(server.GetWordFrequencies(2).begin()->first.data() == get<0>(server.MatchDocument("and"s, 2))[0].data());
+    ASSERT(server.GetWordFrequencies(1).count("in"sv) == 0);
+
+    // A word longer than an arena block still gets interned
+    const vector<Document> long_word_found = server.FindTopDocuments(long_word, DocumentStatus::BANNED);
+    ASSERT_EQUAL(long_word_found.size(), 1u);
+    ASSERT_EQUAL(long_word_found[0].id, 3);
+    ASSERT_EQUAL(get<0>(server.MatchDocument(long_word, 3))[0].size(), long_word.size());
+
+    // Stop words are terms of their own and never indexed; unknown words match nothing
+    ASSERT(server.FindTopDocuments("in the"s).empty());
+    ASSERT_EQUAL(server.FindTopDocuments("cat -bird fox"s).size(), 2u);
+    ASSERT(server.FindTopDocuments("fox -cat"s).empty());
+
+    // A removed word is found again once the word is added back, under the same term
+    const string_view dog = get<0>(server.MatchDocument("dog"s, 2))[0];
+    server.RemoveDocument(2);
+    ASSERT(server.FindTopDocuments("dog"s).empty());
+    server.AddDocument(4, "dog"s, DocumentStatus::ACTUAL, {4});
+    const vector<Document> dog_found = server.FindTopDocuments("dog"s);
+    ASSERT_EQUAL(dog_found.size(), 1u);
+    ASSERT_EQUAL(dog_found[0].id, 4);
+    ASSERT(get<0>(server.MatchDocument("dog"s, 4))[0].data() == dog.data());
+
+    // Words that were never indexed have the same cached results until one of them is added
+    server.SetQueryCacheCapacity(10);
+    ASSERT_EQUAL(server.FindTopDocuments("dog fox"s).size(), 1u);
+    ASSERT_EQUAL(server.FindTopDocuments("dog owl"s).size(), 1u);
+    ASSERT_EQUAL(server.GetQueryCacheHitCount(), 1u);
+    server.AddDocument(5, "fox"s, DocumentStatus::ACTUAL, {5});
+    ASSERT_EQUAL(server.FindTopDocuments("dog fox"s).size(), 2u);
+    ASSERT_EQUAL(server.FindTopDocuments("dog owl"s).size(), 1u);
 }
 
-#define RUN_TEST(func) RunTestImpl(func, #func)
-#define ASSERT_EQUAL(a, b) AssertEqualImpl((a), (b), #a, #b, __FILE__, __FUNCTION__, __LINE__, ""s)
-#define ASSERT_EQUAL_HINT(a, b, hint) AssertEqualImpl((a), (b), #a, #b, __FILE__, __FUNCTION__, __LINE__, (hint))
-#define ASSERT(a) AssertImpl((a), #a, __FILE__, __FUNCTION__, __LINE__, ""s);
-#define ASSERT_HINT(a, hint) AssertImpl((a), #a, __FILE__, __FUNCTION__, __LINE__, (hint));
+void TestForEachWord() {
+    // Byte by byte reference of the chunked scan
+    const auto split_bytes = [](const string& text) {
+        vector<string> words;
+        bool is_valid = true;
+        string word;
+        for (const char c : text) {
+            is_valid = is_valid && static_cast<unsigned char>(c) >= ' ';
+            if (c != ' ') {
+                word += c;
+            } else if (!word.empty()) {
+                words.push_back(move(word));
+                word.clear();
+            }
+        }
+        if (!word.empty()) {
+            words.push_back(move(word));
+        }
+        return pair(words, is_valid);
+    };
 
-const double EPSILON_TEST = 1e-3;
+    mt19937 generator(28);
+    const string alphabet = "ab   \xd0\xba\xff\x1f"s;
+    for (int i = 0; i < 2'000; ++i) {
+        string text;
+        const int size = uniform_int_distribution(0, 70)(generator);
+        for (int j = 0; j < size; ++j) {
+            // Control characters are rare, so that most texts are valid
+            const char c = alphabet[uniform_int_distribution<size_t>(0, alphabet.size() - 1)(generator)];
+            text += c == '\x1f' && j % 5 != 0 ? 'c' : c;
+        }
+        vector<string> words;
+        const bool is_valid = ForEachWord(text, [&words](string_view word) { words.emplace_back(word); });
+        const auto [expected_words, expected_is_valid] = split_bytes(text);
+        ASSERT_HINT(words == expected_words, text);
+        ASSERT_EQUAL_HINT(is_valid, expected_is_valid, text);
+        ASSERT_EQUAL_HINT(IsValidText(text), expected_is_valid, text);
+    }
 
-// -------- Начало модульных тестов поисковой системы ----------
-void TestConstructors(){
-    {
-        //SearchServer server("\x10"s);
+    // Control characters past the first chunk are rejected too, with the same errors
+    const string long_text = "cat dog bird cat dog bird cat dog bird"s;
+    SearchServer server;
+    server.AddDocument(1, long_text, DocumentStatus::ACTUAL, {1});
+    const auto expect_invalid = [](auto action, const string& hint) {
+        try {
+            action();
+            ASSERT_HINT(false, hint);
+        } catch (const invalid_argument&) {
+        }
+    };
+    expect_invalid([&] { server.AddDocument(2, long_text + " \x01"s, DocumentStatus::ACTUAL, {1}); },
+                   "Control character in a document"s);
+    expect_invalid([&] { server.FindTopDocuments(long_text + "\x1f"s); }, "Control character in a query"s);
+    expect_invalid([&] { server.MatchDocument(long_text + " \x02 cat"s, 1); }, "Control character in a match"s);
+    ASSERT_EQUAL(server.GetDocumentCount(), 1);
+    ASSERT_EQUAL(get<0>(server.MatchDocument(long_text + " \xff"s, 1)).size(), 3u);
+}
+
+void TestFindTopDocumentsAsync() {
+    mt19937 generator(29);
+    const vector<string> words = GenerateDictionary(generator, 100, 4);
+    SearchServer server;
+    for (int id = 0; id < 10'000; ++id) {
+        server.AddDocument(id, words[0] + ' ' + GenerateText(generator, words, 5),
+                           id % 3 == 0 ? DocumentStatus::BANNED : DocumentStatus::ACTUAL, {id % 10});
     }
+    server.WaitForMerges();
+
+    try {
+        server.FindTopDocumentsAsync(words[0]);
+        ASSERT_HINT(false, "Async search without query threads"s);
+    } catch (const logic_error&) {
+    }
+
+    server.SetQueryThreads(2, 8);
+    const auto has_even_id = [](int document_id, DocumentStatus, int) {
+        return document_id % 2 == 0;
+    };
+    vector<future<SearchResult>> futures;
     {
-        //vector<string> words = {"in"s, "\x10"s};
-        //SearchServer server(words);
+        // The query is copied, so the text may go away before the search runs
+        string query = words[1] + " -"s + words[2];
+        futures.push_back(server.FindTopDocumentsAsync(query));
+        futures.push_back(server.FindTopDocumentsAsync(query, DocumentStatus::BANNED, 20));
+        futures.push_back(server.FindTopDocumentsAsync(query, has_even_id, 30));
+        query.assign(query.size(), 'x');
+    }
+    const string query = words[1] + " -"s + words[2];
+    for (const auto& [found, expected] : {pair(futures[0].get(), server.FindTopDocuments(query)),
+                                          pair(futures[1].get(), server.FindTopDocuments(query, DocumentStatus::BANNED, 20)),
+                                          pair(futures[2].get(), server.FindTopDocuments(query, has_even_id, 30))}) {
+        ASSERT(found.is_complete);
+        ASSERT_EQUAL(found.documents.size(), expected.size());
+        for (size_t i = 0; i < expected.size(); ++i) {
+            ASSERT_EQUAL(found.documents[i].id, expected[i].id);
+            ASSERT(abs(found.documents[i].relevance - expected[i].relevance) < EPSILON_TEST);
+        }
+    }
+    try {
+        server.FindTopDocumentsAsync("--"s).get();
+        ASSERT_HINT(false, "Errors of the search reach the future"s);
+    } catch (const invalid_argument&) {
+    }
+
+    // A search cancelled or past its deadline before it starts scores nothing
+    auto cancellation = make_shared<SearchCancellation>();
+    cancellation->Cancel();
+    SearchResult stopped = server.FindTopDocumentsAsync(words[0], DocumentStatus::ACTUAL, 5, cancellation).get();
+    ASSERT(!stopped.is_complete);
+    ASSERT(stopped.documents.empty());
+    cancellation = make_shared<SearchCancellation>(chrono::steady_clock::now());
+    ASSERT(!server.FindTopDocumentsAsync(words[0], DocumentStatus::ACTUAL, 5, cancellation).get().is_complete);
+
+    // A search cancelled while it scores returns the best of the documents it has scored,
+    // which are documents of the full result with the same relevances
+    const size_t top_count = 10'000;
+    const vector<Document> all_documents = server.FindTopDocuments(words[0], DocumentStatus::ACTUAL, top_count);
+    cancellation = make_shared<SearchCancellation>();
+    const auto cancel_on_first = [cancellation](int, DocumentStatus status, int) {
+        cancellation->Cancel();
+        return status == DocumentStatus::ACTUAL;
+    };
+    const SearchResult partial = server.FindTopDocumentsAsync(words[0], cancel_on_first, top_count, cancellation).get();
+    ASSERT(!partial.is_complete);
+    ASSERT(!partial.documents.empty());
+    ASSERT(partial.documents.size() < all_documents.size());
+    map<int, double> all_relevances;
+    for (const Document& document : all_documents) {
+        all_relevances[document.id] = document.relevance;
+    }
+    for (const Document& document : partial.documents) {
+        ASSERT(all_relevances.count(document.id));
+        ASSERT(abs(all_relevances[document.id] - document.relevance) < EPSILON_TEST);
     }
+
+    // Queries beyond the capacity of the queue are rejected at once
+    server.SetQueryThreads(1, 1);
+    promise<void> started;
+    promise<void> release;
+    shared_future<void> released = release.get_future().share();
+    auto is_started = make_shared<atomic<bool>>(false);
+    const auto block_first = [&started, released, is_started](int, DocumentStatus, int) {
+        if (!is_started->exchange(true)) {
+            started.set_value();
+            released.wait();
+        }
+        return true;
+    };
+    future<SearchResult> running = server.FindTopDocumentsAsync(words[0], block_first);
+    started.get_future().wait();
+    future<SearchResult> queued = server.FindTopDocumentsAsync(words[0]);
+    future<SearchResult> rejected = server.FindTopDocumentsAsync(words[0]);
+    try {
+        rejected.get();
+        ASSERT_HINT(false, "Full query queue"s);
+    } catch (const runtime_error&) {
+    }
+    release.set_value();
+    ASSERT_EQUAL(running.get().documents.size(), static_cast<size_t>(MAX_RESULT_DOCUMENT_COUNT));
+    ASSERT_EQUAL(queued.get().documents.size(), static_cast<size_t>(MAX_RESULT_DOCUMENT_COUNT));
+    server.SetQueryThreads(0, 0);
 }
 
-void TestExcludeStopWordsFromAddedDocumentContent() {
-    const int doc_id = 42;
-    const string content = "cat in the city"s;
-    const vector<int> ratings = {1, 2, 3};
-    {
-        SearchServer server(""s);
-        server.AddDocument(doc_id, content, DocumentStatus::ACTUAL, ratings);
-        const auto found_docs = server.FindTopDocuments("in"s);
-        ASSERT_EQUAL_HINT(found_docs.size(), 1u, "Wrong find function"s);
-        const Document& doc0 = found_docs[0];
-        ASSERT_EQUAL_HINT(doc0.id, doc_id, "Wrong ID by FindTopDocuments"s);
+void TestStreamMode() {
+    const string input = "и в на\n"s
+                         "ADD 1 ACTUAL 7,2,7 пушистый кот пушистый хвост\n"s
+                         "ADD 2 ACTUAL 1,2 пушистый пёс и модный ошейник\n"s
+                         "ADD 3 BANNED 1,3,2 большой пёс скворец\n"s
+                         "FIND пушистый пёс\n"s
+                         "ADD 2 ACTUAL - дубль\n"s
+                         "ADD x ACTUAL - кот\n"s
+                         "ADD 5 UNKNOWN - кот\n"s
+                         "ADD 4 ACTUAL 5 ухоженный скворец\r\n"s
+                         "\n"s
+                         "PRINT скворец\n"s
+                         "FIND --пёс\n"s
+                         "FIND скворец\n"s
+                         "FIND дубль"s;
+
+    SearchServer server("и в на"s);
+    server.AddDocument(1, "пушистый кот пушистый хвост"s, DocumentStatus::ACTUAL, {7, 2, 7});
+    server.AddDocument(2, "пушистый пёс и модный ошейник"s, DocumentStatus::ACTUAL, {1, 2});
+    server.AddDocument(3, "большой пёс скворец"s, DocumentStatus::BANNED, {1, 3, 2});
+    ostringstream expected;
+    const auto print_documents = [&expected](const vector<Document>& documents) {
+        for (const Document& document : documents) {
+            expected << "{ document_id = "s << document.id << ", relevance = "s << document.relevance
+                     << ", rating = "s << document.rating << " }\n"s;
+        }
+        expected << '\n';
+    };
+    print_documents(server.FindTopDocuments("пушистый пёс"s));
+    server.AddDocument(4, "ухоженный скворец"s, DocumentStatus::ACTUAL, {5});
+    try {
+        server.FindTopDocuments("--пёс"s);
+        ASSERT_HINT(false, "A query with a double minus has to throw"s);
+    } catch (const invalid_argument& e) {
+        expected << "Error: "s << e.what() << "\n\n"s;
     }
+    print_documents(server.FindTopDocuments("скворец"s));
+    print_documents(server.FindTopDocuments("дубль"s));
+
+    const string output_path = "search_server_stream_test.out"s;
+    const auto run = [&](int input_fd, size_t block_size) {
+        const int output_fd = ::open(output_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        ASSERT_HINT(output_fd >= 0, "Cannot create the output file"s);
+        ostringstream errors;
+        streambuf* const cerr_buffer = cerr.rdbuf(errors.rdbuf());
+        RunStreamMode(input_fd, output_fd, block_size);
+        cerr.rdbuf(cerr_buffer);
+        ::close(output_fd);
+        ASSERT_EQUAL(errors.str(), "Line 6: Document ID is already exist\nLine 7: Wrong number x\n"s
+                                   "Line 8: Unknown document status UNKNOWN\nLine 11: Unknown command PRINT\n"s);
+        ifstream output_file(output_path);
+        return string(istreambuf_iterator<char>(output_file), istreambuf_iterator<char>());
+    };
 
+    // A regular file is mapped
+    const string input_path = "search_server_stream_test.in"s;
     {
-        SearchServer server("in the"s);
-        server.AddDocument(doc_id, content, DocumentStatus::ACTUAL, ratings);
-        
-        const auto found_docs = server.FindTopDocuments("in"s);
-        ASSERT_HINT(found_docs.empty(), "Stop words must be excluded from documents"s);
-        
-        const auto [matched_doc_42g, status42g] = server.MatchDocument("cat"s, 42);
-        ASSERT_HINT(!matched_doc_42g.empty(), "Wrong to match good words"s);
-        
-        const auto [matched_doc_42b, status42b] = server.MatchDocument("-cat"s, 42);
-        ASSERT_HINT(matched_doc_42b.empty(), "Wrong to match minus words"s);
-        
-        const auto [matched_doc_stop, status_stop] = server.MatchDocument("in"s, 42);
-        ASSERT_HINT(matched_doc_stop.empty(), "Wrong to match stop words"s);
+        ofstream input_file(input_path);
+        input_file << input;
+    }
+    const int input_fd = ::open(input_path.c_str(), O_RDONLY);
+    ASSERT_HINT(input_fd >= 0, "Cannot open the input file"s);
+    ASSERT_EQUAL_HINT(run(input_fd, LineBlockReader::DEFAULT_BLOCK_SIZE), expected.str(),
+                      "Wrong output for a file"s);
+    ::close(input_fd);
+
+    // A pipe is read in blocks, which are shorter than some lines here
+    int pipe_fds[2];
+    ASSERT(pipe(pipe_fds) == 0);
+    thread writer([&input, fd = pipe_fds[1]] {
+        for (size_t written = 0; written < input.size();) {
+            const ssize_t count = ::write(fd, input.data() + written, min<size_t>(input.size() - written, 5));
+            if (count <= 0) {
+                break;
+            }
+            written += count;
+        }
+        ::close(fd);
+    });
+    const string pipe_output = run(pipe_fds[0], 7);
+    writer.join();
+    ::close(pipe_fds[0]);
+    ASSERT_EQUAL_HINT(pipe_output, expected.str(), "Wrong output for a pipe"s);
+
+    remove(input_path.c_str());
+    remove(output_path.c_str());
+}
+
+void TestSearchServer() {
+    RUN_TEST(TestConstructors);
+    RUN_TEST(TestExcludeStopWordsFromAddedDocumentContent);
+    RUN_TEST(TestMinusWordsExcluded);
+    RUN_TEST(TestMatchFunction);
+    RUN_TEST(TestFindTopDocumentsPredicate);
+    RUN_TEST(TestFindTopDocumentsStatus);
+    RUN_TEST(TestFindTopDocuments);
+    RUN_TEST(TestSortByRelevance);
+    RUN_TEST(TestComputingRating);
+    RUN_TEST(TestComputingRelevance);
+    RUN_TEST(TestCountOfDocuments);
+    RUN_TEST(TestGetDocumentId);
+    RUN_TEST(TestPostingListsKeepDocumentOrder);
+    RUN_TEST(TestPredicateGetsDocumentData);
+    RUN_TEST(TestThrowingPredicate);
+    RUN_TEST(TestParallelMatchesSequential);
+    RUN_TEST(TestTopCount);
+    RUN_TEST(TestProcessQueries);
+    RUN_TEST(TestStringViewParsing);
+    RUN_TEST(TestQueryDuplicateWords);
+    RUN_TEST(TestRemoveDocument);
+    RUN_TEST(TestRemoveDuplicates);
+    RUN_TEST(TestInverseDocumentFreqUpdates);
+    RUN_TEST(TestConcurrentSearchServer);
+    RUN_TEST(TestSegmentedIndex);
+    RUN_TEST(TestSaveAndOpenIndex);
+    RUN_TEST(TestIndexFileValidation);
+    RUN_TEST(TestShardedSearchServer);
+    RUN_TEST(TestCompressedPostings);
+    RUN_TEST(TestTopDocumentsPruning);
+    RUN_TEST(TestStatusAndMinusWordSets);
+    RUN_TEST(TestQueryMemoryResource);
+    RUN_TEST(TestQueryCache);
+    RUN_TEST(TestLogDuration);
+    RUN_TEST(TestSearchProfile);
+    RUN_TEST(TestRequestQueue);
+    RUN_TEST(TestPaginator);
+    RUN_TEST(TestAddDocuments);
+    RUN_TEST(TestShardedStatusQueries);
+    RUN_TEST(TestTermDictionary);
+    RUN_TEST(TestForEachWord);
+    RUN_TEST(TestFindTopDocumentsAsync);
+    RUN_TEST(TestStreamMode);
+
+}
+// --------- Окончание модульных тестов поисковой системы -----------
+
+// -------- Начало бенчмарков поисковой системы ----------
+template <typename Func>
+void RunBenchmarkImpl(const Func& func, const string& name) {
+    LOG_DURATION(name);
+    func();
+}
+
+#define RUN_BENCHMARK(name, func) RunBenchmarkImpl((func), (name))
 
+// The map<string, map<int, double>> index SearchServer used before the flat posting lists
+class LegacyMapIndex {
+public:
+    void AddDocument(int document_id, const string& document, int rating) {
+        const vector<string_view> words = SplitIntoWords(document);
+        const double inv_word_count = 1.0 / words.size();
+        for (const string_view word : words) {
+            word_to_document_freqs_[string(word)][document_id] += inv_word_count;
+        }
+        ratings_.emplace(document_id, rating);
     }
-    {
-        //SearchServer server(""s);
-        //server.AddDocument(2, "чук \x02 гек", DocumentStatus::ACTUAL, {3});
+
+    vector<Document> FindTopDocuments(const string& raw_query) const {
+        set<string> plus_words;
+        for (const string_view word : SplitIntoWords(raw_query)) {
+            plus_words.emplace(word);
+        }
+        map<int, double> document_to_relevance;
+        for (const string& word : plus_words) {
+            if (word_to_document_freqs_.count(word) == 0) {
+                continue;
+            }
+            const double inverse_document_freq =
+                log(ratings_.size() * 1.0 / word_to_document_freqs_.at(word).size());
+            for (const auto& [document_id, term_freq] : word_to_document_freqs_.at(word)) {
+                document_to_relevance[document_id] += term_freq * inverse_document_freq;
+            }
+        }
+        vector<Document> result;
+        for (const auto& [document_id, relevance] : document_to_relevance) {
+            result.push_back({document_id, relevance, ratings_.at(document_id)});
+        }
+        sort(result.begin(), result.end(), [](const Document& lhs, const Document& rhs) {
+            if (abs(lhs.relevance - rhs.relevance) < EPSILON) {
+                return lhs.rating > rhs.rating;
+            }
+            return lhs.relevance > rhs.relevance;
+        });
+        if (result.size() > MAX_RESULT_DOCUMENT_COUNT) {
+            result.resize(MAX_RESULT_DOCUMENT_COUNT);
+        }
+        return result;
     }
-    {   
-        /* SearchServer server(""s);
-        server.AddDocument(1, "чук и гек", DocumentStatus::ACTUAL, {3});
-        server.AddDocument(1, "пьют чай", DocumentStatus::ACTUAL, {3, 4, 1}); */
+
+private:
+    map<string, map<int, double>> word_to_document_freqs_;
+    map<int, int> ratings_;
+};
+
+void BenchmarkIndexLayouts(int document_count) {
+    mt19937 generator;
+    const vector<string> dictionary = GenerateDictionary(generator, 20'000, 10);
+    vector<string> documents;
+    documents.reserve(document_count);
+    for (int i = 0; i < document_count; ++i) {
+        documents.push_back(GenerateText(generator, dictionary, 10));
     }
-    {
-        //SearchServer server(""s);
-        //server.AddDocument(-11, "чук и гек", DocumentStatus::ACTUAL, {3});
+    vector<string> queries;
+    for (int i = 0; i < 1'000; ++i) {
+        queries.push_back(GenerateText(generator, dictionary, 5));
+    }
+
+    LegacyMapIndex legacy_index;
+    SearchServer search_server;
+    RUN_BENCHMARK("Legacy map index: AddDocument"s, [&] {
+        for (int i = 0; i < document_count; ++i) {
+            legacy_index.AddDocument(i, documents[i], 1);
+        }
+    });
+    RUN_BENCHMARK("Flat posting lists: AddDocument"s, [&] {
+        for (int i = 0; i < document_count; ++i) {
+            search_server.AddDocument(i, documents[i], DocumentStatus::ACTUAL, {1});
+        }
+    });
+
+    double legacy_relevance = 0.0;
+    double flat_relevance = 0.0;
+    RUN_BENCHMARK("Legacy map index: FindTopDocuments"s, [&] {
+        for (const string& query : queries) {
+            for (const Document& document : legacy_index.FindTopDocuments(query)) {
+                legacy_relevance += document.relevance;
+            }
+        }
+    });
+    RUN_BENCHMARK("Flat posting lists: FindTopDocuments"s, [&] {
+        for (const string& query : queries) {
+            for (const Document& document : search_server.FindTopDocuments(query)) {
+                flat_relevance += document.relevance;
+            }
+        }
+    });
+    cerr << "Total relevance: "s << legacy_relevance << " vs "s << flat_relevance << endl;
+}
+
+void BenchmarkTopDocumentsSelection(int document_count) {
+    mt19937 generator;
+    vector<Document> documents;
+    documents.reserve(document_count);
+    for (int i = 0; i < document_count; ++i) {
+        documents.push_back({i, uniform_int_distribution(0, 1000)(generator) * 0.001,
+                             uniform_int_distribution(-10, 10)(generator)});
     }
+
+    const int repeat_count = 10;
+    int checksum = 0;
+    RUN_BENCHMARK("Full sort and resize"s, [&] {
+        for (int i = 0; i < repeat_count; ++i) {
+            vector<Document> result = documents;
+            sort(result.begin(), result.end(), CompareDocuments);
+            result.resize(MAX_RESULT_DOCUMENT_COUNT);
+            checksum += result[0].id;
+        }
+    });
+    RUN_BENCHMARK("Partial sort of top documents"s, [&] {
+        for (int i = 0; i < repeat_count; ++i) {
+            vector<Document> result = documents;
+            partial_sort(result.begin(), result.begin() + MAX_RESULT_DOCUMENT_COUNT, result.end(),
+                         CompareDocuments);
+            result.resize(MAX_RESULT_DOCUMENT_COUNT);
+            checksum -= result[0].id;
+        }
+    });
+    cerr << "Checksum (must be 0): "s << checksum << endl;
 }
 
-void TestMinusWordsExcluded(){
-    SearchServer server(""s);
-    server.AddDocument(12,"sweet home alabama in"s, DocumentStatus::ACTUAL, {1});
-    server.AddDocument(4,"love me tender love me too"s, DocumentStatus::ACTUAL, {12, 1, 5});
+// The set<string> based query parsing SearchServer used before string_view and sorted vectors
+struct LegacyQuery {
+    set<string> plus_words;
+    set<string> minus_words;
+    set<string> stop_words;
+};
+
+LegacyQuery LegacyParseQuery(const string& text, const set<string>& stop_words) {
+    LegacyQuery query;
+    vector<string> words;
+    string current_word;
+    for (const char c : text + ' ') {
+        if (c != ' ') {
+            current_word += c;
+        } else if (!current_word.empty()) {
+            words.push_back(current_word);
+            current_word.clear();
+        }
+    }
+    for (string word : words) {
+        const bool is_minus = word[0] == '-';
+        if (is_minus) {
+            word = word.substr(1);
+        }
+        if (stop_words.count(word)) {
+            query.stop_words.insert(word);
+        } else if (is_minus) {
+            query.minus_words.insert(word);
+        } else {
+            query.plus_words.insert(word);
+        }
+    }
+    return query;
+}
+
+void BenchmarkParseQuery() {
+    mt19937 generator;
+    const vector<string> dictionary = GenerateDictionary(generator, 10'000, 12);
+    vector<string> queries;
+    for (int i = 0; i < 100'000; ++i) {
+        string query = GenerateText(generator, dictionary, uniform_int_distribution(5, 20)(generator));
+        query += " -"s + dictionary[i % dictionary.size()];
+        queries.push_back(move(query));
+    }
+    const vector<string> stop_word_list(dictionary.begin(), dictionary.begin() + 20);
+    const set<string> stop_words(stop_word_list.begin(), stop_word_list.end());
+
+    size_t word_count = 0;
+    RUN_BENCHMARK("Legacy ParseQuery with set<string>"s, [&] {
+        for (const string& query : queries) {
+            word_count += LegacyParseQuery(query, stop_words).plus_words.size();
+        }
+    });
+    // Nothing is indexed, so the search time is the time Query parsing takes
+    const SearchServer search_server(stop_word_list);
+    RUN_BENCHMARK("ParseQuery into term IDs"s, [&] {
+        for (const string& query : queries) {
+            word_count += search_server.FindTopDocuments(query).size();
+        }
+    });
+    cerr << "Parsed words: "s << word_count << endl;
+}
+
+// Documents were split byte by byte, and then every word was checked for control characters apart
+vector<string_view> LegacySplitIntoValidWords(string_view text) {
+    vector<string_view> words;
+    while (true) {
+        const size_t word_begin = text.find_first_not_of(' ');
+        if (word_begin == text.npos) {
+            break;
+        }
+        text.remove_prefix(word_begin);
+        const size_t word_end = min(text.find(' '), text.size());
+        words.push_back(text.substr(0, word_end));
+        text.remove_prefix(word_end);
+    }
+    for (const string_view word : words) {
+        if (any_of(word.begin(), word.end(), [](char c) { return c >= '\0' && c < ' '; })) {
+            throw invalid_argument("Invalid word try to add"s);
+        }
+    }
+    return words;
+}
+
+void BenchmarkTokenizer() {
+    mt19937 generator;
+    const vector<string> dictionary = GenerateDictionary(generator, 10'000, 12);
+    vector<string> texts;
+    for (int i = 0; i < 10'000; ++i) {
+        // Several kilobytes per document, with runs of spaces
+        string text = GenerateText(generator, dictionary, 600);
+        for (size_t j = i % 13; j < text.size(); j += 97) {
+            text.insert(j, "   "s);
+        }
+        texts.push_back(move(text));
+    }
+
+    size_t word_count = 0;
+    RUN_BENCHMARK("Byte by byte split, then validation"s, [&] {
+        for (const string& text : texts) {
+            word_count += LegacySplitIntoValidWords(text).size();
+        }
+    });
+    RUN_BENCHMARK("Chunked split with validation"s, [&] {
+        for (const string& text : texts) {
+            vector<string_view> words;
+            if (!ForEachWord(text, [&words](string_view word) { words.push_back(word); })) {
+                throw invalid_argument("Invalid word try to add"s);
+            }
+            word_count += words.size();
+        }
+    });
+    cerr << "Words: "s << word_count << endl;
+}
+
+void BenchmarkOpenIndex(int document_count) {
+    mt19937 generator;
+    const vector<string> dictionary = GenerateDictionary(generator, 20'000, 10);
+    vector<string> queries;
+    for (int i = 0; i < 1'000; ++i) {
+        queries.push_back(GenerateText(generator, dictionary, 5));
+    }
+    const string path = "search_server_benchmark.index"s;
+
+    double built_relevance = 0.0;
     {
-        const auto found_docs = server.FindTopDocuments("-in love"s);
-        ASSERT_EQUAL_HINT(found_docs.size(), 1u, "Minus words should be deleted"s);
-        ASSERT(found_docs[0].id == 4);
+        SearchServer search_server;
+        RUN_BENCHMARK("Rebuild from text: AddDocument"s, [&] {
+            for (int i = 0; i < document_count; ++i) {
+                search_server.AddDocument(i, GenerateText(generator, dictionary, 10), DocumentStatus::ACTUAL, {1});
+            }
+        });
+        RUN_BENCHMARK("SaveIndex"s, [&] {
+            search_server.SaveIndex(path);
+        });
+        for (const string& query : queries) {
+            for (const Document& document : search_server.FindTopDocuments(query)) {
+                built_relevance += document.relevance;
+            }
+        }
+    }
+
+    double mapped_relevance = 0.0;
+    unique_ptr<SearchServer> search_server;
+    RUN_BENCHMARK("OpenIndex"s, [&] {
+        search_server = make_unique<SearchServer>(SearchServer::OpenIndex(path));
+    });
+    RUN_BENCHMARK("Mapped index: FindTopDocuments"s, [&] {
+        for (const string& query : queries) {
+            for (const Document& document : search_server->FindTopDocuments(query)) {
+                mapped_relevance += document.relevance;
+            }
+        }
+    });
+    cerr << "Total relevance: "s << built_relevance << " vs "s << mapped_relevance << endl;
+    remove(path.c_str());
+}
+
+void BenchmarkPostingCompression(int document_count) {
+    mt19937 generator;
+    const vector<string> dictionary = GenerateDictionary(generator, 20'000, 10);
+    vector<string> queries;
+    for (int i = 0; i < 1'000; ++i) {
+        queries.push_back(GenerateText(generator, dictionary, 5));
     }
-    {
-        const auto found_docs = server.FindTopDocuments("in -love"s);
-        ASSERT_EQUAL_HINT(found_docs.size(), 1u, "Minus words should be deleted"s);
-        ASSERT(found_docs[0].id == 12);
+    SearchServer search_server;
+    for (int i = 0; i < document_count; ++i) {
+        search_server.AddDocument(i, GenerateText(generator, dictionary, 10), DocumentStatus::ACTUAL, {1});
     }
-    {
-        const auto found_docs = server.FindTopDocuments("-in -love"s);
-        ASSERT_EQUAL_HINT(found_docs.size(), 0, "Minus words should be deleted"s);
+    search_server.WaitForMerges();
+
+    size_t posting_count = 0;
+    for (int i = 0; i < document_count; ++i) {
+        posting_count += search_server.GetWordFrequencies(i).size();
     }
+    // Flat arrays of int ordinals and double term frequencies took 12 bytes per posting,
+    // a node of map<int, double> takes about 48
+    cerr << "Compressed postings: "s << static_cast<double>(search_server.GetPostingMemoryUsage()) / posting_count
+         << " bytes per posting, flat arrays: "s << sizeof(int) + sizeof(double) << endl;
+    double relevance = 0.0;
+    RUN_BENCHMARK("Compressed postings: FindTopDocuments"s, [&] {
+        for (const string& query : queries) {
+            for (const Document& document : search_server.FindTopDocuments(query)) {
+                relevance += document.relevance;
+            }
+        }
+    });
+    cerr << "Total relevance: "s << relevance << endl;
 }
 
-void TestMatchFunction() {
-    SearchServer server(""s);
-    const string expected_word = "love"s;
-
-    server.AddDocument(12,"sweet home alabama in"s, DocumentStatus::ACTUAL, {1});
-    server.AddDocument(4,"love me tender love me too"s, DocumentStatus::ACTUAL, {12, 1, 5});
-    server.AddDocument(42,"I sit and wait any angels"s, DocumentStatus::BANNED, {-2, 3});
-    {
-        const auto [docs, status] = server.MatchDocument("love sweet"s, 4);
-        ASSERT_HINT((docs.size() == 1u) && (docs.at(0) == expected_word), "It has wrong plus word"s);
-        ASSERT_EQUAL_HINT(static_cast<int> (status), static_cast<int> (DocumentStatus::ACTUAL), "It has wrong Document status"s);
+void BenchmarkTopDocumentsPruning(int document_count) {
+    mt19937 generator;
+    const vector<string> common_words = GenerateDictionary(generator, 100, 4);
+    const vector<string> rare_words = GenerateDictionary(generator, 20'000, 10);
+    SearchServer search_server;
+    for (int i = 0; i < document_count; ++i) {
+        search_server.AddDocument(i, GenerateText(generator, common_words, 5) + " "s
+                                  + GenerateText(generator, rare_words, 5), DocumentStatus::ACTUAL, {1});
     }
-    {
-        const auto [docs, status] = server.MatchDocument("love -love"s, 4);
-        ASSERT_HINT(docs.size()== 0u, "It has wrong minus words"s);
+    search_server.WaitForMerges();
+    vector<string> queries;
+    for (int i = 0; i < 200; ++i) {
+        queries.push_back(GenerateText(generator, common_words, 3) + " "s + GenerateText(generator, rare_words, 2));
     }
-    {
-        const auto [docs, status] = server.MatchDocument("sweet -home"s, 12);
-        ASSERT_HINT(docs.size()== 0u, "It has wrong minus words"s);
+
+    const auto all = [](int, DocumentStatus, int) { return true; };
+    int exhaustive_checksum = 0;
+    int pruned_checksum = 0;
+    RUN_BENCHMARK("All documents scored"s, [&] {
+        for (const string& query : queries) {
+            const vector<Document> documents = search_server.FindTopDocuments(query, all, document_count);
+            for (size_t i = 0; i < min(documents.size(), static_cast<size_t>(MAX_RESULT_DOCUMENT_COUNT)); ++i) {
+                exhaustive_checksum += documents[i].id;
+            }
+        }
+    });
+    RUN_BENCHMARK("MaxScore with block maxima"s, [&] {
+        for (const string& query : queries) {
+            for (const Document& document : search_server.FindTopDocuments(query, all)) {
+                pruned_checksum += document.id;
+            }
+        }
+    });
+    cerr << "Checksum of top documents: "s << exhaustive_checksum << " vs "s << pruned_checksum << endl;
+}
+
+void BenchmarkStatusFiltering(int document_count) {
+    mt19937 generator;
+    const vector<string> words = GenerateDictionary(generator, 1'000, 5);
+    SearchServer search_server;
+    for (int i = 0; i < document_count; ++i) {
+        search_server.AddDocument(i, GenerateText(generator, words, 10),
+                                  i % 50 == 0 ? DocumentStatus::BANNED : DocumentStatus::ACTUAL, {1});
     }
-    {
-        const auto [docs, status] = server.MatchDocument("sit -home"s, 42);
-        ASSERT_HINT(docs.size()== 1u, "It has wrong minus words"s);
-        ASSERT_EQUAL_HINT(static_cast<int> (status), static_cast<int> (DocumentStatus::BANNED), "It has wrong Document status"s);
+    search_server.WaitForMerges();
+    vector<string> queries;
+    for (int i = 0; i < 200; ++i) {
+        queries.push_back(GenerateText(generator, words, 3) + " -"s + words[i]);
     }
-    {
-        const auto [docs, status] = server.MatchDocument("sit any"s, 42);
-        ASSERT_HINT(docs.size()== 2u, "It has added wrong plus words"s);
+
+    const auto is_banned = [](int, DocumentStatus status, int) { return status == DocumentStatus::BANNED; };
+    int predicate_checksum = 0;
+    int status_checksum = 0;
+    RUN_BENCHMARK("Status checked by predicate"s, [&] {
+        for (const string& query : queries) {
+            for (const Document& document : search_server.FindTopDocuments(query, is_banned)) {
+                predicate_checksum += document.id;
+            }
+        }
+    });
+    RUN_BENCHMARK("Status ordinal set"s, [&] {
+        for (const string& query : queries) {
+            for (const Document& document : search_server.FindTopDocuments(query, DocumentStatus::BANNED)) {
+                status_checksum += document.id;
+            }
+        }
+    });
+    cerr << "Checksum of top documents: "s << predicate_checksum << " vs "s << status_checksum << endl;
+}
+
+void BenchmarkActiveSegmentScoring() {
+    mt19937 generator;
+    const vector<string> dictionary = GenerateDictionary(generator, 200, 5);
+    // Small enough to stay in the active segment, where every matching document is scored
+    SearchServer search_server;
+    for (int i = 0; i < 4'000; ++i) {
+        search_server.AddDocument(i, GenerateText(generator, dictionary, 20), DocumentStatus::ACTUAL, {1});
     }
-    {
-        const auto [docs, status] = server.MatchDocument("-sit -home"s, 42);
-        ASSERT_HINT(docs.size()== 0u, "It has explicated wrong minus words"s);
+    vector<string> queries;
+    for (int i = 0; i < 2'000; ++i) {
+        queries.push_back(GenerateText(generator, dictionary, 5));
     }
-    {
-        /*const auto [matched_doc_wrong, status_wrong] = server.MatchDocument("кот \x02", 2);
-        ASSERT_HINT(!matched_doc_wrong.empty(), "Wrong to match non-usable words"s);
-        
-        const auto [matched_minmin, status_minmin] = server.MatchDocument("--кот", 2);
-        ASSERT_HINT(!matched_minmin.empty(), "Wrong match --"s); 
-        
-        const auto [matched_id, status_id] = server.MatchDocument("кот", 2);
-        ASSERT_HINT(!matched_id.empty(), "Wrong id"s); 
 
-        const auto [matched_min, status_min] = server.MatchDocument("sit -", 42);
-        ASSERT_HINT(!matched_min.empty(), "Wrong match -"s); */
-    }
+    double relevance = 0.0;
+    RUN_BENCHMARK("Active segment: FindTopDocuments"s, [&] {
+        for (const string& query : queries) {
+            for (const Document& document : search_server.FindTopDocuments(query)) {
+                relevance += document.relevance;
+            }
+        }
+    });
+    RUN_BENCHMARK("Active segment: parallel FindTopDocuments"s, [&] {
+        for (const string& query : queries) {
+            for (const Document& document : search_server.FindTopDocuments(execution::par, query)) {
+                relevance += document.relevance;
+            }
+        }
+    });
+    cerr << "Total relevance: "s << relevance << endl;
 }
 
-void TestFindTopDocumentsPredicate() {
-    SearchServer server("и в на"s);
-    server.AddDocument(12, "белый кот и модный ошейник"s, DocumentStatus::ACTUAL, {1});
-    server.AddDocument(4, "пушистый кот пушистый хвост"s, DocumentStatus::ACTUAL, {12, 1, 5});
-    server.AddDocument(42, "ухоженный пёс выразительные глаза"s, DocumentStatus::BANNED, {-2, 5, 3});
-   
-    vector<Document> b = {{4, 0.6507, 6}, {42, 0.2746, 2}, {12, 0.1014, 1}}; 
-    vector<Document> a = server.FindTopDocuments("пушистый ухоженный кот"s, 
-                        [](int document_id, DocumentStatus status, int rating) {return document_id > 0;});
-    {
-        ASSERT_HINT(a.size() == 3u, "Wrong found amount of documents"s);
-        ASSERT_HINT(abs(a[0].relevance - b[0].relevance) <= EPSILON_TEST, "Wrong relevance by EPSILON_TEST"s);
-        ASSERT_HINT(abs(a[1].relevance - b[1].relevance) <= EPSILON_TEST, "Wrong relevance by EPSILON_TEST"s);
-        ASSERT_HINT(abs(a[2].relevance - b[2].relevance) <= EPSILON_TEST, "Wrong relevance by EPSILON_TEST"s);
-        ASSERT_EQUAL_HINT(a[0].rating, b[0].rating, "Wrong rating find"s);
-        ASSERT_EQUAL_HINT(a[1].rating, b[1].rating, "Wrong rating find"s);
-        ASSERT_EQUAL_HINT(a[2].rating, b[2].rating, "Wrong rating find"s);
+void BenchmarkQueryCache(int document_count) {
+    mt19937 generator;
+    const vector<string> dictionary = GenerateDictionary(generator, 20'000, 10);
+    SearchServer search_server;
+    for (int i = 0; i < document_count; ++i) {
+        search_server.AddDocument(i, GenerateText(generator, dictionary, 10), DocumentStatus::ACTUAL, {1});
     }
-    {
-        b = {{4, 0.6507, 6}};
-        a = server.FindTopDocuments("пушистый ухоженный кот"s, 
-            [](int document_id, DocumentStatus status, int rating) {return rating >= 5;});
-        
-        ASSERT_HINT(a.size() == 1u, "Wrong filtration by rating"s);
-        ASSERT_HINT(abs(a[0].relevance - b[0].relevance) <= EPSILON_TEST, "Wrong relevance by EPSILON_TEST (with rating filter)"s);
-        ASSERT_EQUAL_HINT(a[0].rating, b[0].rating, "Wrong rating find (with rating filter)"s);
+    search_server.WaitForMerges();
+    // About 40% of the traffic goes to the top 1% of the distinct queries
+    vector<string> distinct_queries;
+    for (int i = 0; i < 1'000; ++i) {
+        distinct_queries.push_back(GenerateText(generator, dictionary, 3));
     }
-    {
-        b = {{4, 0.6507, 6}, {12, 0.1014, 1}};
-        a = server.FindTopDocuments("пушистый ухоженный кот"s, 
-            [](int document_id, DocumentStatus status, int rating) {return status == DocumentStatus::ACTUAL;});
-        
-        ASSERT_HINT(a.size() == 2u, "Wrong filtration by status"s);
-        ASSERT_HINT(abs(a[0].relevance - b[0].relevance) <= EPSILON_TEST, "Wrong relevance by EPSILON_TEST (with status filter)"s);
-        ASSERT_HINT(abs(a[1].relevance - b[1].relevance) <= EPSILON_TEST, "Wrong relevance by EPSILON_TEST (with status filter)"s);
-        ASSERT_EQUAL_HINT(a[0].rating, b[0].rating, "Wrong rating find (with status filter)"s);
-        ASSERT_EQUAL_HINT(a[1].rating, b[1].rating, "Wrong rating find (with status filter)"s);
+    vector<string> queries;
+    for (int i = 0; i < 10'000; ++i) {
+        const size_t index = generator() % 5 < 2 ? generator() % 10 : generator() % distinct_queries.size();
+        queries.push_back(distinct_queries[index]);
     }
+
+    double uncached_relevance = 0.0;
+    double cached_relevance = 0.0;
+    RUN_BENCHMARK("Without query cache"s, [&] {
+        for (const string& query : queries) {
+            for (const Document& document : search_server.FindTopDocuments(query)) {
+                uncached_relevance += document.relevance;
+            }
+        }
+    });
+    search_server.SetQueryCacheCapacity(100);
+    RUN_BENCHMARK("Query cache of 100 queries"s, [&] {
+        for (const string& query : queries) {
+            for (const Document& document : search_server.FindTopDocuments(query)) {
+                cached_relevance += document.relevance;
+            }
+        }
+    });
+    cerr << "Cache hits: "s << search_server.GetQueryCacheHitCount() << ", misses: "s
+         << search_server.GetQueryCacheMissCount() << endl;
+    cerr << "Total relevance: "s << uncached_relevance << " vs "s << cached_relevance << endl;
 }
 
-void TestFindTopDocumentsStatus() {
-    SearchServer server("и в на"s);
-    server.AddDocument(12, "белый кот и модный ошейник"s, DocumentStatus::ACTUAL, {1});
-    server.AddDocument(4, "пушистый кот пушистый хвост"s, DocumentStatus::ACTUAL, {12, 1, 5});
-    server.AddDocument(42, "ухоженный пёс выразительные глаза"s, DocumentStatus::BANNED, {-2, 5, 3});
+// Ranks in [0, value_count) with the probability of rank r proportional to 1 / (r + 1)^exponent
+class ZipfGenerator {
+public:
+    ZipfGenerator(int value_count, double exponent)
+        : cumulative_weights_(value_count) {
+        double weight_sum = 0.0;
+        for (int rank = 0; rank < value_count; ++rank) {
+            weight_sum += 1.0 / pow(rank + 1, exponent);
+            cumulative_weights_[rank] = weight_sum;
+        }
+    }
 
-    {
-        vector<Document> a = server.FindTopDocuments("пушистый ухоженный кот"s, DocumentStatus::ACTUAL);
-        ASSERT_HINT(a.size() == 2u, "Wrong find by status"s);
+    int operator()(mt19937& generator) const {
+        const double value = uniform_real_distribution<double>(0.0, cumulative_weights_.back())(generator);
+        const auto it = upper_bound(cumulative_weights_.begin(), cumulative_weights_.end(), value);
+        return min<int>(it - cumulative_weights_.begin(), cumulative_weights_.size() - 1);
     }
-}
 
-void TestFindTopDocuments() {
-    SearchServer server("и в на"s);
-    server.AddDocument(12, "белый кот и модный ошейник"s, DocumentStatus::IRRELEVANT, {1});
-    server.AddDocument(4, "пушистый кот пушистый хвост"s, DocumentStatus::ACTUAL, {12, 1, 5});
-    server.AddDocument(42, "ухоженный пёс выразительные глаза"s, DocumentStatus::BANNED, {-2, 5, 3});
+private:
+    vector<double> cumulative_weights_;
+};
 
-    {
-        vector<Document> a = server.FindTopDocuments("пушистый ухоженный кот"s);
-        ASSERT_HINT(a.size() == 1u, "Wrong find by default"s);
+string GenerateZipfText(mt19937& generator, const vector<string>& dictionary, const ZipfGenerator& ranks,
+                        int word_count) {
+    string text;
+    for (int i = 0; i < word_count; ++i) {
+        if (i > 0) {
+            text.push_back(' ');
+        }
+        text += dictionary[ranks(generator)];
     }
-    {
-        /* const auto found_wrong_doc = server.FindTopDocuments("кот \x02");
-        ASSERT_HINT(!found_wrong_doc.empty(), "Wrong to find non-usable words"s);
-        
-        const auto found_doc_1 = server.FindTopDocuments("-");
-        ASSERT_HINT(!found_doc_1.empty(), "Wrong to find minus"s);
+    return text;
+}
 
-        const auto found_doc_minus = server.FindTopDocuments("кот -");
-        ASSERT_HINT(!found_doc_minus.empty(), "Wrong to find minus"s);
-        
-        const auto found_minmin = server.FindTopDocuments("--кот");
-        ASSERT_HINT(!found_minmin.empty(), "Wrong to find --"s); */
+// Durations of single operations, reported as throughput and latency percentiles
+class LatencyRecorder {
+public:
+    template <typename Func>
+    void Measure(const Func& func) {
+        const auto start = chrono::steady_clock::now();
+        func();
+        latencies_.push_back(chrono::steady_clock::now() - start);
     }
-}
 
-void TestSortByRelevance() {
-    SearchServer server("и в на"s);
-    server.AddDocument(12, "белый кот и модный ошейник"s, DocumentStatus::ACTUAL, {1});
-    server.AddDocument(4, "пушистый кот пушистый хвост"s, DocumentStatus::ACTUAL, {12, 1, 5});
-    server.AddDocument(42, "ухоженный пёс выразительные глаза"s, DocumentStatus::ACTUAL, {-2, 5, 3});
-    
-    {
-        vector<Document> a = server.FindTopDocuments("пушистый ухоженный кот"s);
-        ASSERT_HINT(a.size() == 3u, "Wrong found vector of document size"s);
-        ASSERT_HINT((a[0].relevance >= a[1].relevance) && (a[1].relevance >= a[2].relevance), "Wrong sort by relevancet"s);
+    void Report(const string& name, int operations_per_measure = 1) {
+        if (latencies_.empty()) {
+            return;
+        }
+        const chrono::duration<double> total = accumulate(latencies_.begin(), latencies_.end(),
+                                                          chrono::steady_clock::duration{});
+        sort(latencies_.begin(), latencies_.end());
+        const auto get_percentile = [this](double percentile) {
+            const size_t index = min(static_cast<size_t>(percentile * latencies_.size()), latencies_.size() - 1);
+            return chrono::duration<double, micro>(latencies_[index]).count();
+        };
+        cerr << name << ": "s << static_cast<long long>(latencies_.size() * operations_per_measure / total.count())
+             << " ops/s, p50 "s << get_percentile(0.5) << " us, p99 "s << get_percentile(0.99) << " us"s << endl;
+        latencies_.clear();
     }
-}
 
-void TestComputingRating() {
-    SearchServer server("и в на"s);
-    server.AddDocument(12, "белый кот и модный ошейник"s, DocumentStatus::ACTUAL, {1});
-    server.AddDocument(4, "пушистый кот пушистый хвост"s, DocumentStatus::ACTUAL, {12, 1, 5});
-    server.AddDocument(42, "ухоженный пёс выразительные глаза"s, DocumentStatus::ACTUAL, {-2, 5, 3});
+private:
+    vector<chrono::steady_clock::duration> latencies_;
+};
 
-    vector<Document> a = server.FindTopDocuments("пушистый ухоженный кот"s);
-    ASSERT_HINT((a[0].rating == 6) && (a[1].rating == 2) && (a[2].rating == 1), "Wrong rating calculating"s);
+long long GetPeakRssKilobytes() {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
 }
 
-void TestComputingRelevance() {
-    SearchServer server("и в на"s);
-    server.AddDocument(12, "белый кот и модный ошейник"s, DocumentStatus::ACTUAL, {1});
-    server.AddDocument(4, "пушистый кот пушистый хвост"s, DocumentStatus::ACTUAL, {12, 1, 5});
-    server.AddDocument(42, "ухоженный пёс выразительные глаза"s, DocumentStatus::ACTUAL, {-2, 5, 3});
+// Hot paths over a reproducible corpus whose words follow Zipf's law, like natural text:
+// the most frequent words are the stop words, and queries are drawn from the same law
+void RunBenchmarkSuite(int document_count) {
+    cerr << "-- "s << document_count << " documents --"s << endl;
+    mt19937 generator(document_count);
+    const vector<string> dictionary = GenerateDictionary(generator, 100'000, 10);
+    const ZipfGenerator ranks(dictionary.size(), 1.0);
+    const vector<string> stop_words(dictionary.begin(), dictionary.begin() + 10);
+    const auto get_status = [](int id) {
+        return id % 10 == 0 ? DocumentStatus::BANNED : DocumentStatus::ACTUAL;
+    };
 
-    vector<Document> a = server.FindTopDocuments("пушистый ухоженный кот"s);
-    vector<Document> b = {{4, 0.6507, 6}, {42, 0.2746, 2}, {12, 0.1014, 1}}; 
+    SearchServer search_server(stop_words);
+    LatencyRecorder recorder;
+    // Documents are generated in batches and only AddDocument is timed
+    constexpr int BATCH_SIZE = 100'000;
+    vector<string> documents;
+    for (int first_id = 0; first_id < document_count; first_id += BATCH_SIZE) {
+        const int last_id = min(document_count, first_id + BATCH_SIZE);
+        documents.clear();
+        for (int id = first_id; id < last_id; ++id) {
+            documents.push_back(GenerateZipfText(generator, dictionary, ranks,
+                                                 uniform_int_distribution(10, 30)(generator)));
+        }
+        for (int id = first_id; id < last_id; ++id) {
+            recorder.Measure([&] {
+                search_server.AddDocument(id, documents[id - first_id], get_status(id), {id % 10, id % 7});
+            });
+        }
+    }
+    recorder.Report("AddDocument"s);
+    documents = {};
+    RUN_BENCHMARK("Merges after AddDocument"s, [&] {
+        search_server.WaitForMerges();
+    });
 
-    ASSERT_EQUAL_HINT(a.size(), b.size(), "Wrong find by default (wrong size of documents found)"s);
-    ASSERT_HINT((a[0].relevance - b[0].relevance) <= EPSILON_TEST, "Wrong computing relevance"s);
-    ASSERT_HINT((a[1].relevance - b[1].relevance) <= EPSILON_TEST, "Wrong computing relevance"s);
-    ASSERT_HINT((a[2].relevance - b[2].relevance) <= EPSILON_TEST, "Wrong computing relevance"s);
-    
-}
+    vector<string> queries;
+    for (int i = 0; i < 2'000; ++i) {
+        string query = GenerateZipfText(generator, dictionary, ranks, uniform_int_distribution(1, 4)(generator));
+        if (i % 4 == 0) {
+            query += " -"s + dictionary[ranks(generator)];
+        }
+        queries.push_back(move(query));
+    }
 
-void TestCountOfDocuments() {
-    SearchServer server(""s);
-    ASSERT_EQUAL_HINT(server.GetDocumentCount(), 0, "Wrong object init(should be o documents)"s);
-    server.AddDocument(12, "белый кот и модный ошейник"s, DocumentStatus::ACTUAL, {1});
-    ASSERT_EQUAL_HINT(server.GetDocumentCount(), 1u, "Wrong counting document"s);
-    server.AddDocument(4, "пушистый кот пушистый хвост"s, DocumentStatus::ACTUAL, {12, 1, 5});
-    ASSERT_EQUAL_HINT(server.GetDocumentCount(), 2u, "Wrong counting document"s);
-    server.AddDocument(42, "ухоженный пёс выразительные глаза"s, DocumentStatus::ACTUAL, {-2, 5, 3});
-    ASSERT_EQUAL_HINT(server.GetDocumentCount(), 3u, "Wrong counting document"s);
-}
+    // Nothing is indexed, so the search time is the time Query parsing takes
+    const SearchServer empty_server(stop_words);
+    for (const string& query : queries) {
+        recorder.Measure([&] { empty_server.FindTopDocuments(query); });
+    }
+    recorder.Report("ParseQuery"s);
 
-void TestGetDocumentId(){
-    SearchServer server("и в на"s);
-    server.AddDocument(12, "белый кот и модный ошейник"s, DocumentStatus::ACTUAL, {1});
-    server.AddDocument(4, "пушистый кот пушистый хвост"s, DocumentStatus::ACTUAL, {12, 1, 5});
-    server.AddDocument(42, "ухоженный пёс выразительные глаза"s, DocumentStatus::ACTUAL, {-2, 5, 3});
+    size_t found_count = 0;
+    for (const string& query : queries) {
+        recorder.Measure([&] { found_count += search_server.FindTopDocuments(query, DocumentStatus::ACTUAL).size(); });
+    }
+    recorder.Report("FindTopDocuments by status"s);
+    for (const string& query : queries) {
+        recorder.Measure([&] {
+            found_count += search_server.FindTopDocuments(execution::par, query, DocumentStatus::ACTUAL).size();
+        });
+    }
+    recorder.Report("Parallel FindTopDocuments by status"s);
+    const auto is_even_rated = [](int, DocumentStatus status, int rating) {
+        return status == DocumentStatus::ACTUAL && rating % 2 == 0;
+    };
+    for (const string& query : queries) {
+        recorder.Measure([&] { found_count += search_server.FindTopDocuments(query, is_even_rated).size(); });
+    }
+    recorder.Report("FindTopDocuments by predicate"s);
 
-    {
-        int doc_id = server.GetDocumentId(1);
-        ASSERT_HINT(doc_id == 4, "Wrong ID"s);
+    size_t matched_count = 0;
+    for (size_t i = 0; i < queries.size(); ++i) {
+        const int document_id = generator() % document_count;
+        recorder.Measure([&] { matched_count += get<0>(search_server.MatchDocument(queries[i], document_id)).size(); });
     }
-    {
-        //int doc_id = server.GetDocumentId(12);
+    recorder.Report("MatchDocument"s);
+
+    constexpr int QUERY_BATCH_SIZE = 100;
+    for (size_t first = 0; first + QUERY_BATCH_SIZE <= queries.size(); first += QUERY_BATCH_SIZE) {
+        const vector<string> batch(queries.begin() + first, queries.begin() + first + QUERY_BATCH_SIZE);
+        recorder.Measure([&] { found_count += ProcessQueriesJoined(search_server, batch).size(); });
     }
+    recorder.Report("ProcessQueriesJoined, batches of "s + to_string(QUERY_BATCH_SIZE), QUERY_BATCH_SIZE);
+
+    cerr << "Found documents: "s << found_count << ", matched words: "s << matched_count << endl;
+    cerr << "Peak RSS: "s << GetPeakRssKilobytes() / 1024 << " MB"s << endl;
+    search_server.GetProfile().WriteMetrics(cerr);
 }
 
-void TestSearchServer() {
-    RUN_TEST(TestConstructors);
-    RUN_TEST(TestExcludeStopWordsFromAddedDocumentContent);
-    RUN_TEST(TestMinusWordsExcluded);
-    RUN_TEST(TestMatchFunction);
-    RUN_TEST(TestFindTopDocumentsPredicate);
-    RUN_TEST(TestFindTopDocumentsStatus);
-    RUN_TEST(TestFindTopDocuments);
-    RUN_TEST(TestSortByRelevance);
-    RUN_TEST(TestComputingRating);
-    RUN_TEST(TestComputingRelevance);
-    RUN_TEST(TestCountOfDocuments);
-    RUN_TEST(TestGetDocumentId);
+void BenchmarkAddDocuments(int document_count) {
+    mt19937 generator;
+    const vector<string> dictionary = GenerateDictionary(generator, 20'000, 10);
+    vector<string> texts;
+    texts.reserve(document_count);
+    for (int i = 0; i < document_count; ++i) {
+        texts.push_back(GenerateText(generator, dictionary, 10));
+    }
+    vector<DocumentRecord> records;
+    records.reserve(document_count);
+    for (int i = 0; i < document_count; ++i) {
+        records.push_back({i, texts[i], DocumentStatus::ACTUAL, {1}});
+    }
 
+    SearchServer sequential_server;
+    RUN_BENCHMARK("AddDocument one by one"s, [&] {
+        for (const DocumentRecord& record : records) {
+            sequential_server.AddDocument(record.id, record.text, record.status, record.ratings);
+        }
+        sequential_server.WaitForMerges();
+    });
+    SearchServer bulk_server;
+    RUN_BENCHMARK("AddDocuments on "s + to_string(thread::hardware_concurrency()) + " threads"s, [&] {
+        bulk_server.AddDocuments(records);
+        bulk_server.WaitForMerges();
+    });
+    cerr << "Documents: "s << sequential_server.GetDocumentCount() << " vs "s << bulk_server.GetDocumentCount() << endl;
 }
-// --------- Окончание модульных тестов поисковой системы -----------
 
-int main() {
+void BenchmarkStreamMode(int document_count) {
+    mt19937 generator;
+    const vector<string> dictionary = GenerateDictionary(generator, 20'000, 10);
+    const string path = "search_server_benchmark.stream"s;
+    {
+        ofstream input(path);
+        input << "a an the\n"s;
+        for (int i = 0; i < document_count; ++i) {
+            input << "ADD "s << i << " ACTUAL 1,2,3 "s << GenerateText(generator, dictionary, 10) << '\n';
+        }
+        for (int i = 0; i < document_count / 10; ++i) {
+            input << "FIND "s << GenerateText(generator, dictionary, 3) << '\n';
+        }
+    }
+
+    size_t legacy_document_count = 0;
+    RUN_BENCHMARK("getline, AddDocument and FindTopDocuments one by one"s, [&] {
+        ifstream input(path);
+        ofstream output("/dev/null"s);
+        string line;
+        getline(input, line);
+        SearchServer search_server(line);
+        while (getline(input, line)) {
+            istringstream fields(line);
+            string command;
+            fields >> command;
+            if (command == "ADD"s) {
+                int id = 0;
+                string status;
+                string ratings;
+                fields >> id >> status >> ratings;
+                fields.get();
+                string text;
+                getline(fields, text);
+                search_server.AddDocument(id, text, DocumentStatus::ACTUAL, {1, 2, 3});
+            } else {
+                fields.get();
+                string query;
+                getline(fields, query);
+                for (const Document& document : search_server.FindTopDocuments(query)) {
+                    output << "{ document_id = "s << document.id << ", relevance = "s << document.relevance
+                           << ", rating = "s << document.rating << " }\n"s;
+                }
+                output << endl;
+            }
+        }
+        search_server.WaitForMerges();
+        legacy_document_count = search_server.GetDocumentCount();
+    });
+    RUN_BENCHMARK("Stream mode"s, [&] {
+        const int input_fd = ::open(path.c_str(), O_RDONLY);
+        const int output_fd = ::open("/dev/null", O_WRONLY);
+        RunStreamMode(input_fd, output_fd);
+        ::close(input_fd);
+        ::close(output_fd);
+    });
+    cerr << "Documents: "s << legacy_document_count << endl;
+    remove(path.c_str());
+}
+
+void RunBenchmarks(int document_count) {
+    BenchmarkIndexLayouts(document_count);
+    BenchmarkTopDocumentsSelection(document_count);
+    BenchmarkParseQuery();
+    BenchmarkTokenizer();
+    BenchmarkOpenIndex(document_count);
+    BenchmarkPostingCompression(document_count);
+    BenchmarkTopDocumentsPruning(document_count);
+    BenchmarkStatusFiltering(document_count);
+    BenchmarkActiveSegmentScoring();
+    BenchmarkQueryCache(document_count);
+    BenchmarkAddDocuments(document_count);
+    BenchmarkStreamMode(document_count);
+}
+// -------- Окончание бенчмарков поисковой системы ----------
+
+int main(int argc, char* argv[]) {
+    if (argc > 1 && argv[1] == "--bench"s) {
+        RunBenchmarks(argc > 2 ? stoi(argv[2]) : 1'000'000);
+        return 0;
+    }
+    // --suite [document_count...]: the hot paths over corpora of the given sizes
+    if (argc > 1 && argv[1] == "--suite"s) {
+        vector<int> document_counts;
+        for (int i = 2; i < argc; ++i) {
+            document_counts.push_back(stoi(argv[i]));
+        }
+        if (document_counts.empty()) {
+            document_counts = {10'000, 100'000, 1'000'000};
+        }
+        for (const int document_count : document_counts) {
+            RunBenchmarkSuite(document_count);
+        }
+        return 0;
+    }
+
+    // --stream [path]: commands from the file, or from stdin without a path or with "-"
+    if (argc > 1 && argv[1] == "--stream"s) {
+        const bool from_stdin = argc < 3 || argv[2] == "-"s;
+        const int input_fd = from_stdin ? STDIN_FILENO : ::open(argv[2], O_RDONLY);
+        if (input_fd < 0) {
+            cerr << "Cannot open file "s << argv[2] << endl;
+            return 1;
+        }
+        try {
+            RunStreamMode(input_fd, STDOUT_FILENO);
+        } catch (const exception& e) {
+            cerr << e.what() << endl;
+            return 1;
+        }
+        return 0;
+    }
 
     TestSearchServer();
     // Если вы видите эту строку, значит все тесты прошли успешно